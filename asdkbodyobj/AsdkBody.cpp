@@ -14,6 +14,9 @@
 #include "dbxutil.h"
 #include "rxregsvc.h"
 #include "asdkbody.h"
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
 
 
 
@@ -34,10 +37,98 @@ private:
 };
 
 
+// Output of Body::triangulate() kept between regens, laid out as ready
+// made shell() arguments. The mesh is cut into chunks of at most
+// kMaxShellVertices vertices; inside a chunk every body vertex is stored
+// once and the face list indexes relative to the chunk's first vertex.
+//
+const int kMaxShellVertices = 32768;
+
+// Coarser copies of the mesh for viewport level of detail, made by
+// snapping the vertices to a grid, averaging each cell and dropping the
+// triangles that collapse. They are chunked like the mesh. kLevelCells
+// is the grid resolution along the mesh's diagonal for each level,
+// finest first; a viewport uses the coarsest level whose cells stay
+// within kLodPixelSize on screen.
+//
+const int    kNumLevels = 3;
+const double kLevelCells[kNumLevels] = { 64.0, 16.0, 4.0 };
+const double kLodPixelSize = 2.0;
+
+struct AsdkBodyTessellation
+{
+    struct Chunk
+    {
+        int firstVertex, numVertices;   // range of vertices
+        int firstFace, faceListSize;    // range of faceList
+        int firstEdge;                  // first entry of edgeVisibility
+    };
+
+    AcGePoint3dArray      vertices;
+    AcArray<Adesk::Int32> faceList;
+    AcArray<Adesk::UInt8> edgeVisibility;  // one per face list corner
+    AcArray<Chunk>        chunks;
+    bool                  valid;
+
+    struct Level
+    {
+        double                cellSize;
+        AcGePoint3dArray      vertices;
+        AcArray<Adesk::Int32> faceList;
+        AcArray<Adesk::UInt8> edgeVisibility;
+        AcArray<Chunk>        chunks;
+    };
+
+    Level                 levels[kNumLevels];
+    int                   numLevels;       // levels that pay off, see buildLevels
+    AcGePoint3d           center;          // of the mesh's bounding box
+
+    // Wireframe as chains of body edges for polyline(). Every undirected
+    // edge appears once and bridge edges are left out; chains of sharp
+    // edges come first, then those of approximation edges.
+    //
+    AcGePoint3dArray      wirePoints;
+    AcArray<int>          wireLengths;     // points per chain
+    int                   numSharpChains;
+    bool                  wireValid;
+
+    // Held while the caches above are built or checked. Regens may draw
+    // the same body from several threads, one per viewport.
+    //
+    std::mutex            buildLock;
+
+    AsdkBodyTessellation() 
+        : valid(false), numLevels(0), numSharpChains(0), wireValid(false) {}
+
+    void clear()
+    {
+        vertices.setLogicalLength(0);
+        faceList.setLogicalLength(0);
+        edgeVisibility.setLogicalLength(0);
+        chunks.setLogicalLength(0);
+        numLevels = 0;
+        valid = false;
+    }
+
+    void orderStrips();
+    void buildLevels();
+    int  levelFor(double pixelsPerUnit) const;
+    void draw(AcGiGeometry& geometry, int level) const;
+
+    void buildWire(const Body& b);
+    void drawWire(AcGiWorldDraw* pWorldDraw, bool approxEdges) const;
+
+private:
+    void orderStrips(const Chunk& chunk);
+    void buildLevel(Level& level, const AcGePoint3d& origin);
+    void chainWire(const AcArray<Edge*>& edges);
+};
+
+
 class AsdkBodyAModelerCallBack : public OutputTriangleCallback
 {
 public:
-    AsdkBodyAModelerCallBack(AcGiWorldDraw* pCurWorldDraw) {m_pCurWorldDraw = pCurWorldDraw;}
+    AsdkBodyAModelerCallBack(AsdkBodyTessellation* pMesh) {m_pMesh = pMesh;}
     virtual ~AsdkBodyAModelerCallBack(){;}
 
     // 
@@ -48,40 +139,44 @@ public:
                         bool firstTriangleIsCcw);
 
 private:
-    AcGiWorldDraw* m_pCurWorldDraw;
+    void startChunk();
+
+    AsdkBodyTessellation* m_pMesh;
+
+    // index of each body vertex within the chunk being filled
+    std::unordered_map<Vertex*, Adesk::Int32> m_vertexIndex;
 };
 
 
 static void 
-drawAllEdges(const Body& b, AcGiWorldDraw *pWorldDraw)
-{
-#ifndef NDEBUG
-    Adesk::UInt16 currentColor = pWorldDraw->subEntityTraits().color();
-    Adesk::UInt16 color = currentColor, lastColorSet = currentColor;
-    const Adesk::UInt16 approxColor = 1;
-    const Adesk::UInt16 bridgeColor = 2;
-    const Adesk::UInt16 firstEdgeColor = 3;
-    const Adesk::UInt16 secondEdgeColor = 4;
-    int iEdge = 0, iFaces = b.faceCount();
-#endif
+tessellate(const Body& b, AsdkBodyTessellation* pMesh)
+{
+    std::lock_guard<std::mutex> guard(pMesh->buildLock);
+    if (pMesh->valid)
+        return;
 
-    for (Face* f = b.faceList(); f != NULL; f = f->next())
+    pMesh->clear();
+    AsdkBodyAModelerCallBack AModelerCallBack( pMesh );
+    b.triangulate( &AModelerCallBack );
+    pMesh->orderStrips();
+    pMesh->buildLevels();
+    pMesh->valid = true;
+}
+
+
+static void 
+drawAllEdges(const Body& b, AsdkBodyTessellation* pMesh, AcGiWorldDraw *pWorldDraw,
+    bool approxEdges)
+{
     {
-        if (f->edgeLoop() == NULL)
-            continue;
-        
-        Edge* e = f->edgeLoop();
-        do 
+        std::lock_guard<std::mutex> guard(pMesh->buildLock);
+        if (!pMesh->wireValid)
         {
-            if (true) 
-            {
-                Point3d p[2];
-                p[0] = e->point();
-                p[1] = e->next()->point();
-                pWorldDraw->geometry().polyline(2, (AcGePoint3d*)p);
-            }
-        } while ((e = e->next()) != f->edgeLoop());
+            pMesh->buildWire(b);
+            pMesh->wireValid = true;
+        }
     }
+    pMesh->drawWire(pWorldDraw, approxEdges);
 }
 
 
@@ -91,6 +186,7 @@ drawAllEdges(const Body& b, AcGiWorldDraw *pWorldDraw)
 //
 
 AsdkBody::AsdkBody()
+    : m_pTessellation(new AsdkBodyTessellation)
 {
 
 }
@@ -98,6 +194,25 @@ AsdkBody::AsdkBody()
 
 AsdkBody::~AsdkBody()
 {
+    delete m_pTessellation;
+}
+
+
+AsdkBodyTessellation*
+AsdkBody::tessellation() const
+{
+    return m_pTessellation;
+}
+
+
+void
+AsdkBody::invalidateTessellation()
+{
+    if (m_pTessellation)
+    {
+        m_pTessellation->valid = false;
+        m_pTessellation->wireValid = false;
+    }
 }
 
 
@@ -114,6 +229,7 @@ void
 AsdkBody::createBox(const AcGePoint3d& p, const AcGeVector3d& vec)
 {
 	assertWriteEnabled();
+	invalidateTessellation();
     m_3dGeom = Body::box(*(Point3d*)&p, *(Vector3d*)&vec);
     if (debugMode())
         if (! m_3dGeom.isValid())
@@ -125,6 +241,7 @@ void
 AsdkBody::createSphere(const AcGePoint3d& p, double radius, int approx)
 {
 	assertWriteEnabled();
+	invalidateTessellation();
     m_3dGeom = Body::sphere( *(Point3d*)&p, radius, approx);
     if (debugMode())
 	    if (! m_3dGeom.isValid())
@@ -137,6 +254,7 @@ AsdkBody::createCylinder(const AcGePoint3d& axisStart, const AcGePoint3d& axisEn
     const AcGeVector3d& baseNormal, double radius, int approx)
 {
 	assertWriteEnabled();
+	invalidateTessellation();
     m_3dGeom = Body::cylinder(
         Line3d(*(Point3d*)&axisStart, *(Point3d*)&axisEnd), 
         *(Vector3d*)&baseNormal, 
@@ -153,6 +271,7 @@ AsdkBody::createCone(const AcGePoint3d& axisStart, const AcGePoint3d& axisEnd,
     const AcGeVector3d& baseNormal, double radius1, double radius2, int approx)
 {
 	assertWriteEnabled();
+	invalidateTessellation();
     m_3dGeom = Body::cone(
         Line3d(*(Point3d*)&axisStart, *(Point3d*)&axisEnd), 
         *(Vector3d*)&baseNormal, 
@@ -171,6 +290,7 @@ AsdkBody::createPipe(const AcGePoint3d& axisStart, const AcGePoint3d& axisEnd,
     int approx)
 {
 	assertWriteEnabled();
+	invalidateTessellation();
 	m_3dGeom = Body::pipe(
         Line3d(*(Point3d*)&axisStart, *(Point3d*)&axisEnd),
         *(Vector3d*)&baseNormal,
@@ -195,6 +315,7 @@ AsdkBody::createPipeConic(
     int approx)
 {
 	assertWriteEnabled();
+	invalidateTessellation();
 	m_3dGeom = Body::pipeConic(
         Line3d(*(Point3d*)&axisStart, *(Point3d*)&axisEnd),
         *(Vector3d*)&baseNormal,
@@ -214,6 +335,7 @@ AsdkBody::createTetrahedron(const AcGePoint3d& p1, const AcGePoint3d& p2,
     const AcGePoint3d& p3, const AcGePoint3d& p4)
 {
 	assertWriteEnabled();
+	invalidateTessellation();
     m_3dGeom = Body::tetrahedron(*(Point3d*)&p1, *(Point3d*)&p2,
 	    *(Point3d*)&p3, *(Point3d*)&p4);
     if (debugMode())
@@ -227,6 +349,7 @@ AsdkBody::createTorus(const AcGePoint3d& axisStart, const AcGePoint3d& axisEnd,
     double majorRadius, double minorRadius, int majorApprox, int minorApprox)
 {
 	assertWriteEnabled();
+	invalidateTessellation();
     m_3dGeom = Body::torus(
         Line3d(*(Point3d*)&axisStart, *(Point3d*)&axisEnd),
         majorRadius, 
@@ -251,6 +374,7 @@ AsdkBody::createReducingElbow(
     int minorApprox)
 {
     assertWriteEnabled();                                                   
+    invalidateTessellation();
 	m_3dGeom = Body::reducingElbow(*(Point3d*)&elbowCenter, *(Point3d*)&endCenter1, 
         *(Point3d*)&endCenter2, endRadius1, endRadius2, majorApprox, minorApprox);
     if (debugMode())
@@ -269,6 +393,7 @@ AsdkBody::createRectToCircleReducer(
     int approx)
 {
 	assertWriteEnabled();
+	invalidateTessellation();
 	m_3dGeom = 
     Body::rectangleToCircleReducer(
         *(Point3d*)&baseCorner, 
@@ -289,6 +414,7 @@ void
 AsdkBody::createConvexHull(const AcGePoint3d vertices[], int numVertices)
 {
 	assertWriteEnabled();
+	invalidateTessellation();
 	m_3dGeom = Body::convexHull((Point3d*)vertices, numVertices);
     if (debugMode())
 	    if (! m_3dGeom.isValid())
@@ -301,6 +427,7 @@ AsdkBody::createFace(const AcGePoint3d vertices[], PolygonVertexData* vertexData
     int numVertices, const AcGeVector3d &normal)
 {
 	assertWriteEnabled();
+	invalidateTessellation();
     Face* pFace = new Face((Point3d*)vertices, vertexData, numVertices, 
         *(Vector3d*)&normal, 0, TRUE, &m_3dGeom);
                                                                                  
@@ -313,6 +440,7 @@ void
 AsdkBody::createFace(const AcGePoint3d vertices[], int numVertices)
 {
 	assertWriteEnabled();
+	invalidateTessellation();
     Face* pFace = new Face((Point3d*)vertices, numVertices, 0, TRUE, &m_3dGeom);
                                                                                  
     // I would call m_3dGeom.isValid, but it only works for solids, i.e., 
@@ -329,6 +457,7 @@ AsdkBody::createPyramid(
     const AcGePoint3d &apex)
 {
 	assertWriteEnabled();
+	invalidateTessellation();
 	m_3dGeom = Body::pyramid((Point3d*)vertices, vertexData, numVertices, 
         *(Vector3d*)&plgNormal, *(Point3d*)&apex);
     if (debugMode())
@@ -349,6 +478,7 @@ AsdkBody::createExtrusion(
     double twistAngle)
 {
 	assertWriteEnabled();
+	invalidateTessellation();
 	m_3dGeom = Body::extrusion((Point3d*)vertices, vertexData, numVertices, 
         *(Vector3d*)&plgNormal, *(Vector3d*)&extrusionVector, *(Point3d*)&fixedPt, 
         scaleFactor, twistAngle * (kPi/180));
@@ -372,6 +502,7 @@ AsdkBody::createAxisRevolution(
     double twistAngle)
 {
 	assertWriteEnabled();
+	invalidateTessellation();
     m_3dGeom = Body::axisRevolution(
         (Point3d*)vertices,
         vertexData,
@@ -399,6 +530,7 @@ AsdkBody::createEndpointRevolution(
     int approx)
 {
 	assertWriteEnabled();
+	invalidateTessellation();
     m_3dGeom = Body::endpointRevolution(
         (Point3d*)vertices,
         vertexData,
@@ -420,6 +552,7 @@ AsdkBody::createSkin(
     MorphingMap* morphingMaps[])
 {
 	assertWriteEnabled();
+	invalidateTessellation();
     bool checkPlanarity = debugMode() ? TRUE : FALSE;
     Body **profileBodies = new Body*[numProfiles];
     
@@ -453,6 +586,7 @@ AsdkBody::createExtrusionAlongPath(
     const MorphingMap &morphingMap)
 {
 	assertWriteEnabled();
+	invalidateTessellation();
 	m_3dGeom = Body::extrusionAlongPath(
         startProfile, 
         endProfile, 
@@ -478,6 +612,7 @@ Body&
 AsdkBody::body()
 {
     assertWriteEnabled();
+    invalidateTessellation();
     return m_3dGeom;
 }
 
@@ -508,19 +643,21 @@ AsdkBody::subWorldDraw(AcGiWorldDraw* worldDraw)
     // 
     //graphRep.evaluateWorldDraw(body, worldDraw, defaultColor);
 
+    Adesk::Boolean viewIndependent = Adesk::kTrue;
     switch (worldDraw->regenType()) {
 
     case kAcGiHideOrShadeCommand:
     case kAcGiShadedDisplay:
         
         // 
-        // Draw shells
+        // Sharp edges look the same in every view; the shells are left to
+        // subViewportDraw, which picks a level of detail per viewport.
+        // Approximation edges are left to the shell's silhouettes. The
+        // shells are triangulated here, once, before the viewports draw.
         // 
-        {
-        AsdkBodyAModelerCallBack AModelerCallBack( worldDraw );
-        m_3dGeom.triangulate( &AModelerCallBack );
-        }
-        drawAllEdges(m_3dGeom, worldDraw);
+        drawAllEdges(m_3dGeom, tessellation(), worldDraw, false);
+        tessellate(m_3dGeom, tessellation());
+        viewIndependent = Adesk::kFalse;
         break;
 
     case kAcGiStandardDisplay:
@@ -529,7 +666,7 @@ AsdkBody::subWorldDraw(AcGiWorldDraw* worldDraw)
         // 
         // Draw wireframe with visible hidden lines
         // 
-        drawAllEdges( m_3dGeom, worldDraw );
+        drawAllEdges( m_3dGeom, tessellation(), worldDraw, true );
 
         break;
 
@@ -541,7 +678,41 @@ AsdkBody::subWorldDraw(AcGiWorldDraw* worldDraw)
         break;
     } /*switch*/
     
-    return Adesk::kTrue;   // Don't call viewportDraw().
+    return viewIndependent;   // Call viewportDraw() for shaded modes only.
+}
+
+
+void
+AsdkBody::subViewportDraw(AcGiViewportDraw* viewportDraw)
+{
+    assertReadEnabled();
+
+    if (viewportDraw->regenAbort())
+        return;
+
+    switch (viewportDraw->regenType()) {
+
+    case kAcGiHideOrShadeCommand:
+    case kAcGiShadedDisplay:
+        {
+        // 
+        // Draw shells at the level of detail this view needs. subWorldDraw
+        // has triangulated the body already; tessellate() only checks that
+        // under the lock.
+        // 
+        AsdkBodyTessellation* pMesh = tessellation();
+        tessellate(m_3dGeom, pMesh);
+
+        AcGePoint2d pixels;
+        viewportDraw->viewport().getNumPixelsInUnitSquare(pMesh->center, pixels);
+        double pixelsPerUnit = pixels.x > pixels.y ? pixels.x : pixels.y;
+        pMesh->draw(viewportDraw->geometry(), pMesh->levelFor(pixelsPerUnit));
+        }
+        break;
+
+    default:
+        break;
+    } /*switch*/
 }
 
 
@@ -549,6 +720,7 @@ Acad::ErrorStatus
 AsdkBody::dwgInFields(AcDbDwgFiler* filer)
 {
     assertWriteEnabled();
+    invalidateTessellation();
     Acad::ErrorStatus es;
 
     if ((es = AcDbEntity::dwgInFields(filer)) != Acad::eOk)
@@ -629,6 +801,7 @@ AsdkBody::subTransformBy(const AcGeMatrix3d& xform)
     AcDbDwgFiler *filer;
 
     assertWriteEnabled( Adesk::kFalse );
+    invalidateTessellation();
     if (NULL != (filer = undoFiler()))
     {
         filer->writeAddress(AsdkBody::desc() );
@@ -689,7 +862,7 @@ AsdkBody::applyPartialUndo(AcDbDwgFiler* filer, AcRxClass* classObj)
 void 
 AsdkBodyAModelerCallBack::outputTriangle(Edge* edges[], int numSides)
 {
-    if (!m_pCurWorldDraw)
+    if (!m_pMesh)
         return;
 
     // 
@@ -698,54 +871,597 @@ AsdkBodyAModelerCallBack::outputTriangle(Edge* edges[], int numSides)
     if (numSides < 3 || numSides > 4)   
         return;
 
-    AcGePoint3d points[4];
-    Adesk::UInt32 face_list_size = 1 + numSides;
-    Adesk::Int32* face_list = new Adesk::Int32[face_list_size];
-    AcGiEdgeData edge_data;
-    Adesk::UInt8* edge_vis_array = new Adesk::UInt8[numSides];
-    face_list[0] = numSides;
+    if (m_pMesh->chunks.isEmpty() 
+        || m_pMesh->chunks.last().numVertices + numSides > kMaxShellVertices)
+        startChunk();
+    AsdkBodyTessellation::Chunk& chunk = m_pMesh->chunks.last();
+
+    m_pMesh->faceList.append(numSides);
     for (int i = 0; i < numSides; i++)
     {
-        points[i] = AcGePoint3d(edges[i]->point().x, 
-            edges[i]->point().y, edges[i]->point().z);
+        // 
+        // neighbouring triangles share the body vertex, emit it once
+        // 
+        std::pair<std::unordered_map<Vertex*, Adesk::Int32>::iterator, bool> slot =
+            m_vertexIndex.insert(std::make_pair(edges[i]->vertex(), chunk.numVertices));
+        if (slot.second)
+        {
+            m_pMesh->vertices.append(AcGePoint3d(edges[i]->point().x, 
+                edges[i]->point().y, edges[i]->point().z));
+            chunk.numVertices++;
+        }
                                                                                 
-        face_list[i+1] = i;
+        m_pMesh->faceList.append(slot.first->second);
         if (edges[i]->next() != edges[(i+1)%numSides] 
             || edges[i]->isFlagOn(BEF)) 
         {
             // 
             // triangle edge 
             // 
-            edge_vis_array[i] = kAcGiInvisible;
+            m_pMesh->edgeVisibility.append(kAcGiInvisible);
         }
         else if (edges[i]->isFlagOn(AEF))
         {
-            edge_vis_array[i] = kAcGiSilhouette;
+            m_pMesh->edgeVisibility.append(kAcGiSilhouette);
         }
         else
         {
-            edge_vis_array[i] = kAcGiVisible;
+            m_pMesh->edgeVisibility.append(kAcGiVisible);
         }
     }
-    edge_data.setVisibility(edge_vis_array);
+    chunk.faceListSize += 1 + numSides;
+}
+
+
+void
+AsdkBodyAModelerCallBack::startChunk()
+{
+    AsdkBodyTessellation::Chunk chunk;
+    chunk.firstVertex  = m_pMesh->vertices.length();
+    chunk.numVertices  = 0;
+    chunk.firstFace    = m_pMesh->faceList.length();
+    chunk.faceListSize = 0;
+    chunk.firstEdge    = m_pMesh->edgeVisibility.length();
+    m_pMesh->chunks.append(chunk);
+    m_vertexIndex.clear();
+}
+
+
+void
+AsdkBodyTessellation::draw(AcGiGeometry& geometry, int level) const
+{
+    const Level* coarse = level > 0 ? &levels[level - 1] : NULL;
+    const AcArray<Chunk>& shells = coarse ? coarse->chunks : chunks;
+
+    const AcGePoint3d*  points = coarse ? coarse->vertices.asArrayPtr() : vertices.asArrayPtr();
+    const Adesk::Int32* faces  = coarse ? coarse->faceList.asArrayPtr() : faceList.asArrayPtr();
+    Adesk::UInt8*       vis    = const_cast<Adesk::UInt8*>(coarse 
+        ? coarse->edgeVisibility.asArrayPtr() : edgeVisibility.asArrayPtr());
+
+    for (int i = 0; i < shells.length(); i++)
+    {
+        const Chunk& chunk = shells[i];
+        AcGiEdgeData edge_data;
+        edge_data.setVisibility(vis + chunk.firstEdge);
+
+        // 
+        // set color
+        // Need to figure out wall side to assign correct color
+        // 
+        geometry.shell(chunk.numVertices, points + chunk.firstVertex, 
+            chunk.faceListSize, faces + chunk.firstFace, &edge_data);
+    }
+}
 
+
+void 
+AsdkBodyAModelerCallBack::outputTriStrip(Edge* edgeArray[], 
+    int arrayLength, bool firstTriangleIsCcw)
+{
     // 
-    // set color
-    // Need to figure out wall side to assign correct color
+    // unpack the strip into triangles, every one normalized to ccw so
+    // outputTriangle sees face loop order. that includes the first when
+    // firstTriangleIsCcw is false
     // 
-    m_pCurWorldDraw->geometry().shell(numSides, points, face_list_size, 
-        face_list, &edge_data);
+    for (int i = 0; i + 2 < arrayLength; i++)
+    {
+        Edge* tri[3];
+        bool ccw = ((i & 1) == 0) == firstTriangleIsCcw;
+        tri[0] = edgeArray[ccw ? i : i + 1];
+        tri[1] = edgeArray[ccw ? i + 1 : i];
+        tri[2] = edgeArray[i + 2];
 
-    delete [] face_list;
-    delete [] edge_vis_array;
+        // 
+        // skip the degenerate triangles used to turn or join strips
+        // 
+        if (tri[0]->vertex() == tri[1]->vertex() 
+            || tri[1]->vertex() == tri[2]->vertex() 
+            || tri[2]->vertex() == tri[0]->vertex())
+            continue;
+        outputTriangle(tri, 3);
+    }
 }
 
 
-void 
-AsdkBodyAModelerCallBack::outputTriStrip(Edge* /*edgeArray*/[], 
-    int /*arrayLength*/, bool /* firstTriangleIsCcw */)
+// Polygons of every chunk are reordered along greedy strips over their
+// shared sides, SGI style: start from the polygon with the fewest
+// unvisited neighbours, leave triangles alternately by the left and right
+// side and quads by the side opposite the entry. Consecutive shell faces
+// then reuse the vertices just sent instead of jumping across the body.
+//
+void
+AsdkBodyTessellation::orderStrips()
+{
+    for (int i = 0; i < chunks.length(); i++)
+        orderStrips(chunks[i]);
+}
+
+
+void
+AsdkBodyTessellation::orderStrips(const Chunk& chunk)
+{
+    // 
+    // polygon starts in faceList and in the chunk's sides, side k of a
+    // polygon runs from its corner k to corner k+1
+    // 
+    AcArray<int> faceStart, sideStart;
+    int numSides = 0;
+    for (int f = chunk.firstFace; f < chunk.firstFace + chunk.faceListSize; 
+        f += 1 + faceList[f])
+    {
+        faceStart.append(f);
+        sideStart.append(numSides);
+        numSides += faceList[f];
+    }
+    int numFaces = faceStart.length();
+    if (numFaces < 3)
+        return;
+
+    // 
+    // match every side with the side running back along it
+    // 
+    AcArray<int> mate, sideFace;
+    mate.setLogicalLength(numSides);
+    mate.setAll(-1);
+    sideFace.setLogicalLength(numSides);
+    std::unordered_map<Adesk::UInt64, int> open;
+    for (int p = 0; p < numFaces; p++)
+    {
+        const Adesk::Int32* corners = faceList.asArrayPtr() + faceStart[p] + 1;
+        int n = corners[-1];
+        for (int k = 0; k < n; k++)
+        {
+            int s = sideStart[p] + k;
+            Adesk::UInt32 a = corners[k], b = corners[(k + 1) % n];
+            Adesk::UInt64 key = a < b ? ((Adesk::UInt64)a << 32) | b 
+                : ((Adesk::UInt64)b << 32) | a;
+            sideFace[s] = p;
+            std::pair<std::unordered_map<Adesk::UInt64, int>::iterator, bool> slot =
+                open.insert(std::make_pair(key, s));
+            if (!slot.second)
+            {
+                mate[s] = slot.first->second;
+                mate[slot.first->second] = s;
+                open.erase(slot.first);
+            }
+        }
+    }
+
+    // 
+    // degree is the number of unvisited neighbours, buckets[d] holds
+    // polygons last seen with degree d (stale entries are skipped)
+    // 
+    AcArray<int> degree, order;
+    AcArray<int> buckets[5];
+    AcArray<bool> visited;
+    degree.setLogicalLength(numFaces);
+    visited.setLogicalLength(numFaces);
+    visited.setAll(false);
+    for (int p = 0; p < numFaces; p++)
+    {
+        int n = faceList[faceStart[p]], d = 0;
+        for (int k = 0; k < n; k++)
+            if (mate[sideStart[p] + k] >= 0)
+                d++;
+        degree[p] = d;
+        buckets[d].append(p);
+    }
+
+    for (;;)
+    {
+        int p = -1;
+        for (int d = 0; d < 5 && p < 0; d++)
+        {
+            while (!buckets[d].isEmpty() && p < 0)
+            {
+                int q = buckets[d].last();
+                buckets[d].removeLast();
+                if (!visited[q] && degree[q] == d)
+                    p = q;
+            }
+        }
+        if (p < 0)
+            break;
+
+        int entry = -1, turn = 0;
+        for (;;)
+        {
+            visited[p] = true;
+            order.append(p);
+            int n = faceList[faceStart[p]];
+            for (int k = 0; k < n; k++)
+            {
+                int m = mate[sideStart[p] + k];
+                if (m >= 0 && !visited[sideFace[m]])
+                {
+                    int q = sideFace[m];
+                    degree[q]--;
+                    buckets[degree[q]].append(q);
+                }
+            }
+
+            // 
+            // pick the side to leave by: the strip direction first,
+            // otherwise the neighbour with the fewest ways out
+            // 
+            int exit = -1;
+            if (entry >= 0)
+            {
+                int k = n == 3 ? (entry + 1 + turn) % 3 : (entry + 2) % n;
+                int m = mate[sideStart[p] + k];
+                if (m >= 0 && !visited[sideFace[m]])
+                    exit = k;
+            }
+            bool straight = exit >= 0;
+            for (int k = 0, best = 5; k < n && !straight; k++)
+            {
+                int m = mate[sideStart[p] + k];
+                if (m >= 0 && !visited[sideFace[m]] && degree[sideFace[m]] < best)
+                {
+                    exit = k;
+                    best = degree[sideFace[m]];
+                }
+            }
+            if (exit < 0)
+                break;
+
+            int m = mate[sideStart[p] + exit];
+            p = sideFace[m];
+            entry = m - sideStart[p];
+            turn ^= 1;
+        }
+    }
+
+    // 
+    // write the polygons back in strip order
+    // 
+    AcArray<Adesk::Int32> newFaces;
+    AcArray<Adesk::UInt8> newEdges;
+    newFaces.setPhysicalLength(chunk.faceListSize);
+    newEdges.setPhysicalLength(numSides);
+    for (int i = 0; i < order.length(); i++)
+    {
+        int p = order[i];
+        int n = faceList[faceStart[p]];
+        for (int k = 0; k <= n; k++)
+            newFaces.append(faceList[faceStart[p] + k]);
+        for (int k = 0; k < n; k++)
+            newEdges.append(edgeVisibility[chunk.firstEdge + sideStart[p] + k]);
+    }
+    for (int i = 0; i < chunk.faceListSize; i++)
+        faceList[chunk.firstFace + i] = newFaces[i];
+    for (int i = 0; i < numSides; i++)
+        edgeVisibility[chunk.firstEdge + i] = newEdges[i];
+}
+
+
+// A level is kept only if it halves the vertex count of the finer one
+// kept before it, so dense meshes get the whole chain and small ones,
+// a box say, none at all.
+//
+void
+AsdkBodyTessellation::buildLevels()
+{
+    numLevels = 0;
+    if (vertices.isEmpty())
+        return;
+
+    AcGePoint3d lo = vertices[0], hi = vertices[0];
+    for (int i = 1; i < vertices.length(); i++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            if (vertices[i][k] < lo[k])
+                lo[k] = vertices[i][k];
+            else if (vertices[i][k] > hi[k])
+                hi[k] = vertices[i][k];
+        }
+    }
+    center = lo + (hi - lo) / 2.0;
+    double diagonal = lo.distanceTo(hi);
+    if (diagonal <= 0.0)
+        return;
+
+    int finer = vertices.length();
+    for (int i = 0; i < kNumLevels; i++)
+    {
+        Level& level = levels[numLevels];
+        level.cellSize = diagonal / kLevelCells[i];
+        buildLevel(level, lo);
+        if (2 * level.vertices.length() <= finer)
+        {
+            finer = level.vertices.length();
+            numLevels++;
+        }
+    }
+}
+
+
+void
+AsdkBodyTessellation::buildLevel(Level& level, const AcGePoint3d& origin)
+{
+    level.vertices.setLogicalLength(0);
+    level.faceList.setLogicalLength(0);
+    level.edgeVisibility.setLogicalLength(0);
+    level.chunks.setLogicalLength(0);
+
+    // 
+    // cluster the vertices by grid cell, summing them up for the average
+    // 
+    std::unordered_map<Adesk::UInt64, int> cells;
+    AcGePoint3dArray centers;
+    AcArray<int> cluster, counts;
+    cluster.setLogicalLength(vertices.length());
+    for (int i = 0; i < vertices.length(); i++)
+    {
+        AcGeVector3d offset = (vertices[i] - origin) / level.cellSize;
+        Adesk::UInt64 key = ((Adesk::UInt64)offset.x << 42) 
+            | ((Adesk::UInt64)offset.y << 21) | (Adesk::UInt64)offset.z;
+        std::pair<std::unordered_map<Adesk::UInt64, int>::iterator, bool> slot =
+            cells.insert(std::make_pair(key, centers.length()));
+        if (slot.second)
+        {
+            centers.append(vertices[i]);
+            counts.append(1);
+        }
+        else
+        {
+            centers[slot.first->second] += vertices[i].asVector();
+            counts[slot.first->second]++;
+        }
+        cluster[i] = slot.first->second;
+    }
+    for (int i = 0; i < centers.length(); i++)
+    {
+        AcGePoint3d& p = centers[i];
+        p.set(p.x / counts[i], p.y / counts[i], p.z / counts[i]);
+    }
+
+    // 
+    // quads are split so each half collapses on its own, the diagonal
+    // is invisible; triangles that lose a corner or repeat one already
+    // emitted are dropped
+    // 
+    std::unordered_set<Adesk::UInt64> emitted;
+    std::unordered_map<int, Adesk::Int32> chunkIndex;
+    for (int c = 0; c < chunks.length(); c++)
+    {
+        const Chunk& chunk = chunks[c];
+        int e = chunk.firstEdge;
+        for (int f = chunk.firstFace; f < chunk.firstFace + chunk.faceListSize; 
+            f += 1 + faceList[f])
+        {
+            int n = faceList[f];
+            for (int t = 0; t + 2 < n; t++)
+            {
+                int corner[3] = { 0, t + 1, t + 2 };
+                Adesk::UInt8 vis[3];
+                vis[0] = t == 0 ? edgeVisibility[e] : kAcGiInvisible;
+                vis[1] = edgeVisibility[e + t + 1];
+                vis[2] = t + 3 == n ? edgeVisibility[e + n - 1] : kAcGiInvisible;
+
+                int tri[3];
+                for (int k = 0; k < 3; k++)
+                    tri[k] = cluster[chunk.firstVertex + faceList[f + 1 + corner[k]]];
+                if (tri[0] == tri[1] || tri[1] == tri[2] || tri[2] == tri[0])
+                    continue;
+
+                int lowest = tri[0] < tri[1] ? (tri[0] < tri[2] ? 0 : 2) 
+                    : (tri[1] < tri[2] ? 1 : 2);
+                Adesk::UInt64 key = ((Adesk::UInt64)tri[lowest] << 42) 
+                    | ((Adesk::UInt64)tri[(lowest + 1) % 3] << 21) 
+                    | (Adesk::UInt64)tri[(lowest + 2) % 3];
+                if (!emitted.insert(key).second)
+                    continue;
+
+                // 
+                // chunked like outputTriangle, a cell used by the chunk is
+                // emitted once
+                // 
+                if (level.chunks.isEmpty() 
+                    || level.chunks.last().numVertices + 3 > kMaxShellVertices)
+                {
+                    Chunk next;
+                    next.firstVertex  = level.vertices.length();
+                    next.numVertices  = 0;
+                    next.firstFace    = level.faceList.length();
+                    next.faceListSize = 0;
+                    next.firstEdge    = level.edgeVisibility.length();
+                    level.chunks.append(next);
+                    chunkIndex.clear();
+                }
+                Chunk& shell = level.chunks.last();
+
+                level.faceList.append(3);
+                for (int k = 0; k < 3; k++)
+                {
+                    std::pair<std::unordered_map<int, Adesk::Int32>::iterator, bool> slot =
+                        chunkIndex.insert(std::make_pair(tri[k], shell.numVertices));
+                    if (slot.second)
+                    {
+                        level.vertices.append(centers[tri[k]]);
+                        shell.numVertices++;
+                    }
+                    level.faceList.append(slot.first->second);
+                    level.edgeVisibility.append(vis[k]);
+                }
+                shell.faceListSize += 4;
+            }
+            e += n;
+        }
+    }
+}
+
+
+int
+AsdkBodyTessellation::levelFor(double pixelsPerUnit) const
+{
+    int level = 0;
+    for (int i = 0; i < numLevels; i++)
+        if (levels[i].cellSize * pixelsPerUnit <= kLodPixelSize)
+            level = i + 1;
+    return level;
+}
+
+
+void
+AsdkBodyTessellation::buildWire(const Body& b)
+{
+    wirePoints.setLogicalLength(0);
+    wireLengths.setLogicalLength(0);
+
+    // 
+    // one half of every edge pair, the lesser pointer, unless the edge
+    // has no partner (open bodies, single faces)
+    // 
+    AcArray<Edge*> sharp, approx;
+    for (Face* f = b.faceList(); f != NULL; f = f->next())
+    {
+        if (f->edgeLoop() == NULL)
+            continue;
+        
+        Edge* e = f->edgeLoop();
+        do 
+        {
+            if (!e->isFlagOn(BEF) 
+                && (e->partner() == NULL || std::less<Edge*>()(e, e->partner())))
+            {
+                if (e->isFlagOn(AEF))
+                    approx.append(e);
+                else
+                    sharp.append(e);
+            }
+        } while ((e = e->next()) != f->edgeLoop());
+    }
+
+    chainWire(sharp);
+    numSharpChains = wireLengths.length();
+    chainWire(approx);
+}
+
+
+// Link edges sharing a vertex into chains, walking forward from the end
+// of the chain and then backward from its start until no unused edge is
+// left at either vertex.
+//
+void
+AsdkBodyTessellation::chainWire(const AcArray<Edge*>& edges)
+{
+    int numEdges = edges.length();
+    if (numEdges == 0)
+        return;
+
+    // 
+    // edges incident to each vertex, as ranges of incident[]
+    // 
+    std::unordered_map<Vertex*, int> vertexIndex;
+    AcArray<int> ends, first, incident;
+    ends.setLogicalLength(2 * numEdges);
+    for (int i = 0; i < 2 * numEdges; i++)
+    {
+        Vertex* v = (i & 1) ? edges[i >> 1]->next()->vertex() : edges[i >> 1]->vertex();
+        std::pair<std::unordered_map<Vertex*, int>::iterator, bool> slot =
+            vertexIndex.insert(std::make_pair(v, (int)vertexIndex.size()));
+        ends[i] = slot.first->second;
+    }
+    int numVertices = (int)vertexIndex.size();
+    first.setLogicalLength(numVertices + 1);
+    first.setAll(0);
+    for (int i = 0; i < 2 * numEdges; i++)
+        first[ends[i] + 1]++;
+    for (int v = 0; v < numVertices; v++)
+        first[v + 1] += first[v];
+    AcArray<int> fill(first);
+    incident.setLogicalLength(2 * numEdges);
+    for (int i = 0; i < 2 * numEdges; i++)
+        incident[fill[ends[i]]++] = i;
+
+    AcArray<bool> used;
+    used.setLogicalLength(numEdges);
+    used.setAll(false);
+
+    AcArray<int> chain, back;
+    for (int start = 0; start < numEdges; start++)
+    {
+        if (used[start])
+            continue;
+        used[start] = true;
+
+        chain.setLogicalLength(0);
+        back.setLogicalLength(0);
+        chain.append(2 * start);
+        chain.append(2 * start + 1);
+        for (int pass = 0; pass < 2; pass++)
+        {
+            AcArray<int>& path = pass == 0 ? chain : back;
+            int v = ends[pass == 0 ? 2 * start + 1 : 2 * start];
+            for (;;)
+            {
+                // next unused edge end at v, first[v] skips used ones for good
+                int next = -1;
+                for (int& k = first[v]; k < fill[v] && next < 0; k++)
+                    if (!used[incident[k] >> 1])
+                        next = incident[k];
+                if (next < 0)
+                    break;
+                used[next >> 1] = true;
+                // leave through the other end of the edge
+                int other = next ^ 1;
+                path.append(other);
+                v = ends[other];
+            }
+        }
+
+        // 
+        // back ends walked from the start come first, reversed
+        // 
+        for (int i = back.length() - 1; i >= 0; i--)
+        {
+            int end = back[i];
+            Edge* e = edges[end >> 1];
+            wirePoints.append((end & 1) ? e->next()->point() : e->point());
+        }
+        for (int i = 0; i < chain.length(); i++)
+        {
+            int end = chain[i];
+            Edge* e = edges[end >> 1];
+            wirePoints.append((end & 1) ? e->next()->point() : e->point());
+        }
+        wireLengths.append(back.length() + chain.length());
+    }
+}
+
+
+void
+AsdkBodyTessellation::drawWire(AcGiWorldDraw* pWorldDraw, bool approxEdges) const
 {
-    assert(0);
+    int numChains = approxEdges ? wireLengths.length() : numSharpChains;
+    const AcGePoint3d* points = wirePoints.asArrayPtr();
+    for (int i = 0; i < numChains; i++)
+    {
+        pWorldDraw->geometry().polyline(wireLengths[i], points);
+        points += wireLengths[i];
+    }
 }
 
 
@@ -17,6 +17,8 @@
 
 using namespace AModeler;
 
+struct AsdkBodyTessellation;
+
 #pragma warning(push)
 #pragma warning(disable:4275)
 
@@ -169,6 +171,7 @@ protected:
     // display
     // 
     virtual Adesk::Boolean subWorldDraw(AcGiWorldDraw* mode);
+    virtual void subViewportDraw(AcGiViewportDraw* mode);
 private:
 	// These are here because otherwise dllexport tries to export the
     // private methods of AcDbObject.  They're private in AcDbObject
@@ -183,7 +186,18 @@ private:
     void operator delete[](void *p) {};
     void *operator new[](size_t nSize, const char *file, int line) { return 0;}
 
+    // Drop the cached display mesh; called wherever m_3dGeom may change.
+    //
+    void invalidateTessellation();
+    AsdkBodyTessellation* tessellation() const;
+
     Body m_3dGeom;
+
+    // Triangulation of m_3dGeom and its coarser levels of detail, replayed
+    // by subViewportDraw and built on the first shaded regen after the
+    // body changes.
+    //
+    AsdkBodyTessellation* m_pTessellation;
 };
 
 inline Adesk::Boolean
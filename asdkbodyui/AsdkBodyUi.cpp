@@ -36,6 +36,25 @@
 #include "tchar.h"
 #include "acedCmdNF.h"
 #include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <cmath>
+//the AVX2 kernels are built on every x86 target and picked at run time,
+//define ASDK_NO_AVX2 to build the scalar code only
+#if !defined(ASDK_NO_AVX2) && defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define ASDK_AVX2
+#define ASDK_AVX2_TARGET
+#include <intrin.h>
+#include <immintrin.h>
+#elif !defined(ASDK_NO_AVX2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ASDK_AVX2
+#define ASDK_AVX2_TARGET __attribute__((target("avx2")))
+#include <immintrin.h>
+#endif
 
 #ifdef _DEBUG_WAS_DEFINED
 #define _DEBUG
@@ -69,6 +88,7 @@ void doArray();
 void toObj();
 void doSubstract();
 void test202513();
+void testBoolean();
 
 //
 // Static function prototypes
@@ -95,6 +115,10 @@ static void getPath(AcGePoint3d* &vertices, PolygonVertexData** &vertexData,
     int &iVertices);
 static MorphingMap getMorphingMap(const Body& startProfile, const Body& endProfile);
 static MorphingMap* queryMorphingMap(AsdkBody* pBody1, AsdkBody* pBody2);
+static void getBodyExtents(Body& body, AcGePoint3d& minPt, AcGePoint3d& maxPt);
+static bool bodiesMayOverlap(Body& body1, Body& body2);
+static void orderForUnion(AcArray<Body*>& bodies, AcArray<int>& order);
+static int  reduceUnion(AcArray<Body*>& bodies, const AcArray<int>& order, AcArray<bool>& absorbed);
 
 
 
@@ -135,6 +159,7 @@ CommandInfo commandInfo[] =
     ACRX_T("toObj"),                &toObj,                     ACRX_T(""),
     ACRX_T("doSubstract"),       & doSubstract,                     ACRX_T("1"),
     ACRX_T("test202513"),& test202513,                     ACRX_T("test2025131"),
+    ACRX_T("testBoolean"),          &testBoolean,               ACRX_T("Compare degenerate booleans with AModeler"),
     0,                      0,                          0
 };
 
@@ -1319,7 +1344,7 @@ aUnion()
         return;
     }
 
-    AsdkBody *pFirst = NULL;
+    AcArray<AsdkBody*> ents;
     ads_name first_ent;
     for (long i = 0; i < len; i++)
     {
@@ -1335,34 +1360,190 @@ aUnion()
         if (Acad::eOk != acdbOpenObject( p, id, AcDb::kForWrite ))
             continue;
 
-        if (NULL == pFirst)
+        if (ents.isEmpty())
         {
-            pFirst = p;
             ads_name_set(ent, first_ent);
             //
             // Not sure if this is the right way to copy an ads_name -vm
         }
-        else 
+        ents.append(p);
+    }
+    
+    ads_ssfree( s );
+    if (ents.isEmpty())
+        return;
+
+    // Unite the whole selection at once instead of folding every body
+    // into the first one. The result ends up in the first entity.
+    //
+    AcArray<Body*> bodies;
+    for (int i = 0; i < ents.length(); i++)
+        bodies.append(&ents[i]->body());
+
+    AcArray<int> order;
+    orderForUnion(bodies, order);
+
+    AcArray<bool> absorbed;
+    absorbed.setLogicalLength(ents.length());
+    absorbed.setAll(false);
+    int failures = reduceUnion(bodies, order, absorbed);
+    for (int i = 0; i < failures; i++)
+        ads_printf( ACRX_T("*Invalid*\n") );
+
+    for (int i = 1; i < ents.length(); i++)
+    {
+        if (absorbed[i])
+            ents[i]->erase();
+        ents[i]->close();
+    }
+    ents[0]->close();
+    ads_entupd(first_ent);
+}
+
+
+static void
+getBodyExtents(Body& body, AcGePoint3d& minPt, AcGePoint3d& maxPt)
+{
+    Vertex* v = body.vertexList();
+    if (NULL == v)
+    {
+        minPt = maxPt = AcGePoint3d::kOrigin;
+        return;
+    }
+    minPt = maxPt = v->point();
+    for (v = v->next(); v; v = v->next())
+    {
+        const AcGePoint3d& pt = v->point();
+        for (int k = 0; k < 3; k++)
         {
-            try 
-            {
-                pFirst->body() += p->body();
-                p->erase();
-            }
-            catch (...) 
+            if (pt[k] < minPt[k]) minPt[k] = pt[k];
+            if (pt[k] > maxPt[k]) maxPt[k] = pt[k];
+        }
+    }
+}
+
+
+static bool
+bodiesMayOverlap(Body& body1, Body& body2)
+{
+    AcGePoint3d min1, max1, min2, max2;
+    getBodyExtents(body1, min1, max1);
+    getBodyExtents(body2, min2, max2);
+    double tol = AcGeContext::gTol.equalPoint();
+    for (int k = 0; k < 3; k++)
+    {
+        if (min1[k] > max2[k] + tol || min2[k] > max1[k] + tol)
+            return false;
+    }
+    return true;
+}
+
+
+// Orders the bodies for reduceUnion. Bodies whose boxes touch are put in
+// one group (smallest selection index first), and the members of a group
+// are sorted along the longest axis of the group box, so that neighbours
+// in the order are neighbours in space.
+//
+static void
+orderForUnion(AcArray<Body*>& bodies, AcArray<int>& order)
+{
+    int n = bodies.length();
+    AcArray<AcGePoint3d> mins, maxs;
+    mins.setLogicalLength(n);
+    maxs.setLogicalLength(n);
+    for (int i = 0; i < n; i++)
+        getBodyExtents(*bodies[i], mins[i], maxs[i]);
+
+    AcArray<int> parent;
+    for (int i = 0; i < n; i++)
+        parent.append(i);
+    auto root = [&](int i) {
+        while (parent[i] != i)
+            i = parent[i] = parent[parent[i]];
+        return i;
+    };
+    double tol = AcGeContext::gTol.equalPoint();
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = i + 1; j < n; j++)
+        {
+            bool overlap = true;
+            for (int k = 0; k < 3 && overlap; k++)
+                overlap = mins[i][k] <= maxs[j][k] + tol && mins[j][k] <= maxs[i][k] + tol;
+            if (!overlap)
+                continue;
+            int ri = root(i), rj = root(j);
+            if (ri < rj) parent[rj] = ri;
+            else if (rj < ri) parent[ri] = rj;
+        }
+    }
+
+    order.setLogicalLength(0);
+    for (int r = 0; r < n; r++)
+    {
+        if (root(r) != r)
+            continue;
+        AcArray<int> group;
+        AcGePoint3d gmin = mins[r], gmax = maxs[r];
+        for (int i = r; i < n; i++)
+        {
+            if (root(i) != r)
+                continue;
+            group.append(i);
+            for (int k = 0; k < 3; k++)
             {
-                ads_printf( ACRX_T("*Invalid*\n") );
+                if (mins[i][k] < gmin[k]) gmin[k] = mins[i][k];
+                if (maxs[i][k] > gmax[k]) gmax[k] = maxs[i][k];
             }
-            p->close();
         }
+        AcGeVector3d size = gmax - gmin;
+        int axis = size.x >= size.y ? (size.x >= size.z ? 0 : 2) : (size.y >= size.z ? 1 : 2);
+        std::stable_sort(group.begin(), group.end(), [&](int a, int b) {
+            return mins[a][axis] + maxs[a][axis] < mins[b][axis] + maxs[b][axis];
+        });
+        order.append(group);
     }
-    
-    ads_ssfree( s );
-    if (NULL != pFirst)
+}
+
+
+// Unites the bodies as a balanced tree over order: every level unites
+// neighbouring pairs. A pair keeps its result in the body with the
+// smaller selection index and flags the other one in absorbed, so the
+// final union is in bodies[0]. A pair that throws keeps both bodies as
+// they are. Returns the number of failed pairs.
+//
+// The Facet Modeler is not documented to be reentrant, so the pairs run
+// one after another on the calling thread.
+//
+static int
+reduceUnion(AcArray<Body*>& bodies, const AcArray<int>& order, AcArray<bool>& absorbed)
+{
+    int failures = 0;
+    AcArray<int> level = order;
+    while (level.length() > 1)
     {
-        pFirst->close();
-        ads_entupd(first_ent);
+        int numPairs = level.length() / 2;
+        AcArray<int> next;
+        for (int k = 0; k < numPairs; k++)
+        {
+            int keep = std::min(level[2 * k], level[2 * k + 1]);
+            int other = std::max(level[2 * k], level[2 * k + 1]);
+            next.append(keep);
+            try
+            {
+                *bodies[keep] += *bodies[other];
+                absorbed[other] = true;
+            }
+            catch (...)
+            {
+                failures++;
+            }
+        }
+        if (level.length() % 2)
+            next.append(level.last());
+        level = next;
     }
+    return failures;
 }
 
 
@@ -1410,7 +1591,10 @@ aSubtract()
     }
 
     try {
-        pb1->body() -= pb2->body();
+        // Nothing to cut away when the boxes do not overlap
+        //
+        if (bodiesMayOverlap(pb1->body(), pb2->body()))
+            pb1->body() -= pb2->body();
         pb2->erase();
     }
     catch (...) {
@@ -1443,6 +1627,7 @@ aIntersect()
 
     AsdkBody *pFirst = NULL;
     ads_name first_ent;
+    bool bEmpty = false;
     for (long i = 0; i < len; i++)
     {
         ads_name ent;
@@ -1465,7 +1650,13 @@ aIntersect()
         {
             try 
             {
-                pFirst->body() *= p->body();
+                // Once two boxes are apart the intersection is empty,
+                // the rest of the selection only has to be erased
+                //
+                if (!bEmpty && !bodiesMayOverlap(pFirst->body(), p->body()))
+                    bEmpty = true;
+                if (!bEmpty)
+                    pFirst->body() *= p->body();
                 p->erase();
             }
             catch (...) 
@@ -1478,7 +1669,7 @@ aIntersect()
     ads_ssfree( s );
     if (NULL != pFirst) 
     {
-        if (pFirst->body().isNull()) 
+        if (bEmpty || pFirst->body().isNull()) 
         {
             ads_printf( ACRX_T("Null AsdkBody created - deleted\n") );
             pFirst->erase();
@@ -2514,12 +2705,192 @@ enum faceStatus
     bouta
 };
 
+//bounding box kernels. AcGePoint3d is three packed doubles: with AVX2 one
+//point is loaded into a register with the spare lane masked off, and the
+//contiguous reduction takes four points as three full registers. the loops
+//check hasAvx2() once per call, single boxes stay scalar
+static_assert(sizeof(AcGePoint3d) == 3 * sizeof(double), "packed points");
+
+//true when the cpu and the os run AVX2 code
+inline bool hasAvx2() {
+#if defined(__AVX2__)
+    return true;
+#elif defined(ASDK_AVX2) && defined(_MSC_VER)
+    static const bool avx2 = [] {
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7) {
+            return false;
+        }
+        //osxsave and avx, then the os must save the ymm registers
+        __cpuid(info, 1);
+        if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6) {
+            return false;
+        }
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+    }();
+    return avx2;
+#elif defined(ASDK_AVX2)
+    static const bool avx2 = __builtin_cpu_supports("avx2") != 0;
+    return avx2;
+#else
+    return false;
+#endif
+}
+
+#if defined(ASDK_AVX2)
+ASDK_AVX2_TARGET inline __m256d loadPoint(const AcGePoint3d& pt) {
+    return _mm256_maskload_pd(&pt.x, _mm256_setr_epi64x(-1, -1, -1, 0));
+}
+
+ASDK_AVX2_TARGET inline void storePoint(__m256d v, AcGePoint3d& pt) {
+    _mm256_maskstore_pd(&pt.x, _mm256_setr_epi64x(-1, -1, -1, 0), v);
+}
+
+//extendBox over the first count / 4 * 4 points, returns how many it took
+ASDK_AVX2_TARGET int extendBoxAvx2(const AcGePoint3d* pts, int count, AcGePoint3d& min, AcGePoint3d& max) {
+    if (count < 4) {
+        return 0;
+    }
+    const double* p = &pts[0].x;
+    __m256d lo0 = _mm256_loadu_pd(p), lo1 = _mm256_loadu_pd(p + 4), lo2 = _mm256_loadu_pd(p + 8);
+    __m256d hi0 = lo0, hi1 = lo1, hi2 = lo2;
+    int i = 4;
+    for (; i + 4 <= count; i += 4) {
+        p = &pts[i].x;
+        __m256d r0 = _mm256_loadu_pd(p), r1 = _mm256_loadu_pd(p + 4), r2 = _mm256_loadu_pd(p + 8);
+        lo0 = _mm256_min_pd(lo0, r0); hi0 = _mm256_max_pd(hi0, r0);
+        lo1 = _mm256_min_pd(lo1, r1); hi1 = _mm256_max_pd(hi1, r1);
+        lo2 = _mm256_min_pd(lo2, r2); hi2 = _mm256_max_pd(hi2, r2);
+    }
+    //the lanes hold x y z x, y z x y, z x y z
+    double lo[12], hi[12];
+    _mm256_storeu_pd(lo, lo0); _mm256_storeu_pd(lo + 4, lo1); _mm256_storeu_pd(lo + 8, lo2);
+    _mm256_storeu_pd(hi, hi0); _mm256_storeu_pd(hi + 4, hi1); _mm256_storeu_pd(hi + 8, hi2);
+    for (int k = 0; k < 12; k++) {
+        min[k % 3] = std::min(min[k % 3], lo[k]);
+        max[k % 3] = std::max(max[k % 3], hi[k]);
+    }
+    return i;
+}
+
+ASDK_AVX2_TARGET void extendBoxAvx2(const AcGePoint3d* pts, const int* index, int count, AcGePoint3d& min, AcGePoint3d& max) {
+    __m256d lo = loadPoint(min), hi = loadPoint(max);
+    for (int i = 0; i < count; i++) {
+        __m256d p = loadPoint(pts[index[i]]);
+        lo = _mm256_min_pd(lo, p);
+        hi = _mm256_max_pd(hi, p);
+    }
+    storePoint(lo, min);
+    storePoint(hi, max);
+}
+#endif
+
+//grows min, max by pts[0..count)
+void extendBox(const AcGePoint3d* pts, int count, AcGePoint3d& min, AcGePoint3d& max) {
+    int i = 0;
+#if defined(ASDK_AVX2)
+    if (hasAvx2()) {
+        i = extendBoxAvx2(pts, count, min, max);
+    }
+#endif
+    for (; i < count; i++) {
+        for (int c = 0; c < 3; c++) {
+            min[c] = std::min(min[c], pts[i][c]);
+            max[c] = std::max(max[c], pts[i][c]);
+        }
+    }
+}
+
+//grows min, max by pts[index[0..count)]
+void extendBox(const AcGePoint3d* pts, const int* index, int count, AcGePoint3d& min, AcGePoint3d& max) {
+#if defined(ASDK_AVX2)
+    if (hasAvx2()) {
+        extendBoxAvx2(pts, index, count, min, max);
+        return;
+    }
+#endif
+    for (int i = 0; i < count; i++) {
+        for (int c = 0; c < 3; c++) {
+            min[c] = std::min(min[c], pts[index[i]][c]);
+            max[c] = std::max(max[c], pts[index[i]][c]);
+        }
+    }
+}
+
+//grows min, max by the box [boxMin, boxMax]
+inline void extendBox(const AcGePoint3d& boxMin, const AcGePoint3d& boxMax, AcGePoint3d& min, AcGePoint3d& max) {
+    for (int c = 0; c < 3; c++) {
+        min[c] = std::min(min[c], boxMin[c]);
+        max[c] = std::max(max[c], boxMax[c]);
+    }
+}
+
+//true when the boxes share a point, touching boxes overlap
+inline bool boxesOverlap(const AcGePoint3d& aMin, const AcGePoint3d& aMax, const AcGePoint3d& bMin, const AcGePoint3d& bMax) {
+    for (int c = 0; c < 3; c++) {
+        if (aMin[c] > bMax[c] || aMax[c] < bMin[c]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template<class T>
+const T& boxOf(const T& item) {
+    return item;
+}
+
+template<class T>
+const T& boxOf(T* item) {
+    return *item;
+}
+
+#if defined(ASDK_AVX2)
+template<class T>
+ASDK_AVX2_TARGET unsigned long long overlapMaskAvx2(const T* items, int count, const AcGePoint3d& min, const AcGePoint3d& max) {
+    unsigned long long mask = 0;
+    __m256d lo = loadPoint(min), hi = loadPoint(max);
+    for (int i = 0; i < count; i++) {
+        __m256d apart = _mm256_or_pd(_mm256_cmp_pd(loadPoint(boxOf(items[i]).min), hi, _CMP_GT_OQ),
+            _mm256_cmp_pd(loadPoint(boxOf(items[i]).max), lo, _CMP_LT_OQ));
+        if (_mm256_movemask_pd(apart) == 0) {
+            mask |= 1ull << i;
+        }
+    }
+    return mask;
+}
+#endif
+
+//bit i of the result is set when the box of items[i] overlaps [min, max].
+//items are boxes or pointers to anything with min and max points, count
+//is at most 64
+template<class T>
+unsigned long long overlapMask(const T* items, int count, const AcGePoint3d& min, const AcGePoint3d& max) {
+#if defined(ASDK_AVX2)
+    if (hasAvx2()) {
+        return overlapMaskAvx2(items, count, min, max);
+    }
+#endif
+    unsigned long long mask = 0;
+    for (int i = 0; i < count; i++) {
+        if (boxesOverlap(boxOf(items[i]).min, boxOf(items[i]).max, min, max)) {
+            mask |= 1ull << i;
+        }
+    }
+    return mask;
+}
+
 struct loopBox
 {
     AcGePoint3d min = AcGePoint3d(maxDouble, maxDouble, maxDouble);
     AcGePoint3d max = AcGePoint3d(minDouble, minDouble, minDouble);
 };
 
+//polygon of the splitting stage. unlike struct mesh every face owns its
+//points, loops and loop boxes, a vertex shared by several faces is copied
+//into each of them
 struct face {
     faceStatus status;
     bool bCoincide = false;
@@ -2532,6 +2903,8 @@ struct face {
     AcGePoint3dArray pts;
     AcGePoint3d min = AcGePoint3d(maxDouble, maxDouble, maxDouble);
     AcGePoint3d max = AcGePoint3d(minDouble, minDouble, minDouble);
+    AcGeVector3d planeNormal;//the plane is planeNormal . x + planeD = 0
+    double planeD = 0.0;
     void caculateLoopMaxPtIndex() {
         loopMaxPtIndex.setLogicalLength(loops.length());
         for (int i = 1; i < loops.length(); i++) {
@@ -2558,31 +2931,22 @@ struct face {
     void caculateLoopBoxs() {
         loopBoxs.setLogicalLength(loops.length());
         for (int i = 1; i < loopBoxs.length(); i++) {
-            AcGePoint3d loopmin = AcGePoint3d(maxDouble, maxDouble, maxDouble);
-            AcGePoint3d loopmax = AcGePoint3d(minDouble, minDouble, minDouble);
-            for (auto index : loops[i]) {
-                loopmin.x = std::min(loopmin.x, pts[index].x);
-                loopmin.y = std::min(loopmin.y, pts[index].y);
-                loopmin.z = std::min(loopmin.z, pts[index].z);
-                loopmax.x = std::max(loopmax.x, pts[index].x);
-                loopmax.y = std::max(loopmax.y, pts[index].y);
-                loopmax.z = std::max(loopmax.z, pts[index].z);
-            }
-            loopBoxs[i].min = loopmin;
-            loopBoxs[i].max = loopmax;
+            loopBoxs[i] = loopBox();
+            extendBox(pts.asArrayPtr(), loops[i].asArrayPtr(), loops[i].length(), loopBoxs[i].min, loopBoxs[i].max);
         }
     }
     void caculateBox() {
-        for (auto& p : pts) {
-            min.x = std::min(min.x, p.x);
-            min.y = std::min(min.y, p.y);
-            min.z = std::min(min.z, p.z);
-            max.x = std::max(max.x, p.x);
-            max.y = std::max(max.y, p.y);
-            max.z = std::max(max.z, p.z);
-        }
+        extendBox(pts.asArrayPtr(), pts.length(), min, max);
         bBox = true;
     }
+    void caculatePlane() {
+        planeNormal = normal.normal();
+        planeD = -planeNormal.dotProduct(pts[loops[0][0]].asVector());
+    }
+    //signed distance of pt to the plane
+    double planeDistance(const AcGePoint3d& pt) const {
+        return planeNormal.dotProduct(pt.asVector()) + planeD;
+    }
     void reverse() {
         for (auto& loop : loops) {
             for (int i = 0; i < loop.length() / 2; i++) {
@@ -2590,6 +2954,17 @@ struct face {
             }
         }
     }
+    //bytes of the array buffers owned by the face
+    size_t heapBytes() const {
+        size_t bytes = pts.physicalLength() * sizeof(AcGePoint3d)
+            + loops.physicalLength() * sizeof(AcGeIntArray)
+            + loopBoxs.physicalLength() * sizeof(loopBox)
+            + loopMaxPtIndex.physicalLength() * sizeof(int);
+        for (auto& loop : loops) {
+            bytes += loop.physicalLength() * sizeof(int);
+        }
+        return bytes;
+    }
     face(){}
     face(const face& other) {
         normal = other.normal;
@@ -2597,12 +2972,66 @@ struct face {
         loops = other.loops;
         min = other.min;
         max = other.max;
+        planeNormal = other.planeNormal;
+        planeD = other.planeD;
+    }
+};
+
+//polygon mesh in flat arrays. the coordinates of all faces are in x, y, z,
+//the loops of face i are faceLoops[i] .. faceLoops[i + 1] - 1 and the
+//vertices of loop j are loopVertices[loopStart[j]] .. loopVertices[loopStart[j + 1] - 1].
+//the faces out of a boolean have one loop. only the classified result, the
+//selection and the output are kept here. the splitting stage works on
+//struct face, so the operands are read from AModeler straight into faces
+struct mesh {
+    std::vector<double> x, y, z;
+    AcGeIntArray faceLoops;
+    AcGeIntArray loopStart;
+    AcGeIntArray loopVertices;
+    AcGeVector3dArray normals;
+
+    mesh() {
+        faceLoops.append(0);
+        loopStart.append(0);
+    }
+    int vertexCount() const {
+        return int(x.size());
+    }
+    int faceCount() const {
+        return faceLoops.length() - 1;
+    }
+    AcGePoint3d point(int v) const {
+        return AcGePoint3d(x[v], y[v], z[v]);
+    }
+    int addVertex(const AcGePoint3d& pt) {
+        x.push_back(pt.x);
+        y.push_back(pt.y);
+        z.push_back(pt.z);
+        return int(x.size()) - 1;
+    }
+    //a face without loops, addLoop fills it
+    void addFace(const AcGeVector3d& normal) {
+        normals.append(normal);
+        faceLoops.append(faceLoops.last());
+    }
+    void addLoop(const int* vertices, int count) {
+        for (int i = 0; i < count; i++) {
+            loopVertices.append(vertices[i]);
+        }
+        loopStart.append(loopVertices.length());
+        faceLoops.last()++;
+    }
+    //first loop of face i
+    const int* firstLoop(int i, int& count) const {
+        int loop = faceLoops[i];
+        count = loopStart[loop + 1] - loopStart[loop];
+        return loopVertices.asArrayPtr() + loopStart[loop];
     }
 };
 
+//classified faces before the selection of a boolean
 struct body2 {
-    AcArray<AcGeIntArray> faces;
-    std::vector<AcGePoint3d> pts;
+    mesh m;
     AcArray<faceStatus> fStatus;
     AcArray<bool> coincides;
 };
@@ -2613,22 +3042,363 @@ struct body {
     AcGePoint3d max = AcGePoint3d(minDouble, minDouble, minDouble);
     void caculateBox() {
         for (auto& f : faces) {
-            min.x = std::min(min.x, f->min.x);
-            min.y = std::min(min.y, f->min.y);
-            min.z = std::min(min.z, f->min.z);
-            max.x = std::max(max.x, f->max.x);
-            max.y = std::max(max.y, f->max.y);
-            max.z = std::max(max.z, f->max.z);
+            extendBox(f->min, f->max, min, max);
         }
     }
 };
 
+//monotonic arena of one boolean operation. faces and loop tree nodes are
+//carved out of large blocks and destroyed together by release(), nothing
+//is freed one by one. an arena is used by one thread at a time, the worker
+//threads allocate from arenas of their own that are merged afterwards.
+//only the objects themselves are in the blocks. the AcArray buffers inside
+//them, the points, loops and loop boxes of a face, come from the global
+//heap like any AcArray and are freed when release() destroys the objects.
+//every type made here reports those buffers with heapBytes()
+struct booleanArena {
+    static constexpr size_t blockSize = 64 * 1024;
+    struct block {
+        char* data;
+        size_t size;
+        size_t used;
+    };
+    struct finalizer {
+        void* object;
+        void (*destroy)(void*);
+        size_t (*heapBytes)(const void*);
+    };
+    std::vector<block> blocks;
+    std::vector<finalizer> finalizers;
+    size_t used = 0;
+    size_t highWater = 0;
+
+    booleanArena() {}
+    booleanArena(const booleanArena&) = delete;
+    booleanArena& operator=(const booleanArena&) = delete;
+    ~booleanArena() {
+        release();
+    }
+    template<class T, class... Args>
+    T* make(Args&&... args) {
+        T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        finalizers.push_back({ object,
+            [](void* o) { static_cast<T*>(o)->~T(); },
+            [](const void* o) { return static_cast<const T*>(o)->heapBytes(); } });
+        return object;
+    }
+    //takes over the blocks and objects of other, which is left empty
+    void merge(booleanArena& other) {
+        //the block still being filled stays last
+        blocks.insert(blocks.begin(), other.blocks.begin(), other.blocks.end());
+        finalizers.insert(finalizers.end(), other.finalizers.begin(), other.finalizers.end());
+        used += other.used;
+        highWater = std::max(highWater, used);
+        other.blocks.clear();
+        other.finalizers.clear();
+        other.used = 0;
+    }
+    //destroys every object in reverse order and frees the blocks,
+    //the high-water mark survives
+    void release() {
+        highWater = highWaterMark();
+        for (auto it = finalizers.rbegin(); it != finalizers.rend(); ++it) {
+            it->destroy(it->object);
+        }
+        finalizers.clear();
+        for (auto& b : blocks) {
+            ::operator delete(b.data);
+        }
+        blocks.clear();
+        used = 0;
+    }
+    //peak number of bytes of the operation, the blocks plus the heap
+    //buffers of the objects. the buffers are not tracked allocation by
+    //allocation, their capacities are summed when asked and before every
+    //release(). they only grow while the objects live, so this misses only
+    //the old buffer an array holds while it reallocates
+    size_t highWaterMark() const {
+        size_t heap = 0;
+        for (auto& f : finalizers) {
+            heap += f.heapBytes(f.object);
+        }
+        return std::max(highWater, used + heap);
+    }
+
+private:
+    void* allocate(size_t size, size_t align) {
+        if (!blocks.empty()) {
+            block& b = blocks.back();
+            size_t start = (b.used + align - 1) & ~(align - 1);
+            if (start + size <= b.size) {
+                used += start - b.used + size;
+                b.used = start + size;
+                highWater = std::max(highWater, used);
+                return b.data + start;
+            }
+        }
+        block b;
+        b.size = std::max(blockSize, size);
+        b.data = static_cast<char*>(::operator new(b.size));
+        b.used = size;
+        blocks.push_back(b);
+        used += size;
+        highWater = std::max(highWater, used);
+        return b.data;
+    }
+};
+constexpr size_t booleanArena::blockSize;
+
 enum Edgelocate {
     out = -1,
     in = 1,
     on = 0
 };
 
+//filtered exact predicates after Shewchuk's adaptive arithmetic. the plain
+//double determinant is returned when it is bigger than its error bound,
+//otherwise it is refined with exact expansions, so near degenerate input
+//gets the right sign without any tolerance
+const double predEpsilon = 1.1102230246251565e-16;//2^-53
+const double ccwErrBoundA = (3.0 + 16.0 * predEpsilon) * predEpsilon;
+const double ccwErrBoundB = (2.0 + 12.0 * predEpsilon) * predEpsilon;
+const double ccwErrBoundC = (9.0 + 64.0 * predEpsilon) * predEpsilon * predEpsilon;
+const double resultErrBound = (3.0 + 8.0 * predEpsilon) * predEpsilon;
+
+inline void fastTwoSum(double a, double b, double& x, double& y) {
+    x = a + b;
+    y = b - (x - a);
+}
+
+inline void twoSum(double a, double b, double& x, double& y) {
+    x = a + b;
+    double bv = x - a;
+    double av = x - bv;
+    y = (a - av) + (b - bv);
+}
+
+inline void twoDiffTail(double a, double b, double x, double& y) {
+    double bv = a - x;
+    double av = x + bv;
+    y = (a - av) + (bv - b);
+}
+
+inline void twoDiff(double a, double b, double& x, double& y) {
+    x = a - b;
+    twoDiffTail(a, b, x, y);
+}
+
+inline void twoProduct(double a, double b, double& x, double& y) {
+    x = a * b;
+    y = std::fma(a, b, -x);
+}
+
+//(a1 + a0) - (b1 + b0) as a four component expansion, smallest first
+inline void twoTwoDiff(double a1, double a0, double b1, double b0, double* x) {
+    double i, j, k;
+    twoDiff(a0, b0, i, x[0]);
+    twoSum(a1, i, j, k);
+    twoDiff(k, b1, i, x[1]);
+    twoSum(j, i, x[3], x[2]);
+}
+
+//sum of two expansions with zero components removed, returns its length.
+//the last component has the sign of the sum
+int expansionSum(int elen, const double* e, int flen, const double* f, double* h) {
+    int ei = 0, fi = 0, hi = 0;
+    double q, qnew, hh;
+    double enow = e[0], fnow = f[0];
+    if ((fnow > enow) == (fnow > -enow)) {
+        q = enow;
+        enow = ++ei < elen ? e[ei] : 0.0;
+    }
+    else {
+        q = fnow;
+        fnow = ++fi < flen ? f[fi] : 0.0;
+    }
+    if (ei < elen && fi < flen) {
+        if ((fnow > enow) == (fnow > -enow)) {
+            fastTwoSum(enow, q, qnew, hh);
+            enow = ++ei < elen ? e[ei] : 0.0;
+        }
+        else {
+            fastTwoSum(fnow, q, qnew, hh);
+            fnow = ++fi < flen ? f[fi] : 0.0;
+        }
+        q = qnew;
+        if (hh != 0.0) {
+            h[hi++] = hh;
+        }
+        while (ei < elen && fi < flen) {
+            if ((fnow > enow) == (fnow > -enow)) {
+                twoSum(q, enow, qnew, hh);
+                enow = ++ei < elen ? e[ei] : 0.0;
+            }
+            else {
+                twoSum(q, fnow, qnew, hh);
+                fnow = ++fi < flen ? f[fi] : 0.0;
+            }
+            q = qnew;
+            if (hh != 0.0) {
+                h[hi++] = hh;
+            }
+        }
+    }
+    while (ei < elen) {
+        twoSum(q, enow, qnew, hh);
+        enow = ++ei < elen ? e[ei] : 0.0;
+        q = qnew;
+        if (hh != 0.0) {
+            h[hi++] = hh;
+        }
+    }
+    while (fi < flen) {
+        twoSum(q, fnow, qnew, hh);
+        fnow = ++fi < flen ? f[fi] : 0.0;
+        q = qnew;
+        if (hh != 0.0) {
+            h[hi++] = hh;
+        }
+    }
+    if (q != 0.0 || hi == 0) {
+        h[hi++] = q;
+    }
+    return hi;
+}
+
+double orient2dAdapt(const double* pa, const double* pb, const double* pc, double detsum) {
+    double acx = pa[0] - pc[0], bcx = pb[0] - pc[0];
+    double acy = pa[1] - pc[1], bcy = pb[1] - pc[1];
+    double s1, s0, t1, t0;
+    double b[4], u[4], c1[8], c2[12], d[16];
+    twoProduct(acx, bcy, s1, s0);
+    twoProduct(acy, bcx, t1, t0);
+    twoTwoDiff(s1, s0, t1, t0, b);
+    double det = b[0] + b[1] + b[2] + b[3];
+    double errbound = ccwErrBoundB * detsum;
+    if (det >= errbound || -det >= errbound) {
+        return det;
+    }
+    double acxtail, bcxtail, acytail, bcytail;
+    twoDiffTail(pa[0], pc[0], acx, acxtail);
+    twoDiffTail(pb[0], pc[0], bcx, bcxtail);
+    twoDiffTail(pa[1], pc[1], acy, acytail);
+    twoDiffTail(pb[1], pc[1], bcy, bcytail);
+    if (acxtail == 0.0 && acytail == 0.0 && bcxtail == 0.0 && bcytail == 0.0) {
+        return det;
+    }
+    errbound = ccwErrBoundC * detsum + resultErrBound * std::abs(det);
+    det += (acx * bcytail + bcy * acxtail) - (acy * bcxtail + bcx * acytail);
+    if (det >= errbound || -det >= errbound) {
+        return det;
+    }
+    twoProduct(acxtail, bcy, s1, s0);
+    twoProduct(acytail, bcx, t1, t0);
+    twoTwoDiff(s1, s0, t1, t0, u);
+    int c1length = expansionSum(4, b, 4, u, c1);
+    twoProduct(acx, bcytail, s1, s0);
+    twoProduct(acy, bcxtail, t1, t0);
+    twoTwoDiff(s1, s0, t1, t0, u);
+    int c2length = expansionSum(c1length, c1, 4, u, c2);
+    twoProduct(acxtail, bcytail, s1, s0);
+    twoProduct(acytail, bcxtail, t1, t0);
+    twoTwoDiff(s1, s0, t1, t0, u);
+    int dlength = expansionSum(c2length, c2, 4, u, d);
+    return d[dlength - 1];
+}
+
+//positive when pa, pb, pc turn counterclockwise, zero when collinear
+double orient2d(const double* pa, const double* pb, const double* pc) {
+    double detleft = (pa[0] - pc[0]) * (pb[1] - pc[1]);
+    double detright = (pa[1] - pc[1]) * (pb[0] - pc[0]);
+    double det = detleft - detright;
+    double detsum;
+    if (detleft > 0.0) {
+        if (detright <= 0.0) {
+            return det;
+        }
+        detsum = detleft + detright;
+    }
+    else if (detleft < 0.0) {
+        if (detright >= 0.0) {
+            return det;
+        }
+        detsum = -detleft - detright;
+    }
+    else {
+        return det;
+    }
+    double errbound = ccwErrBoundA * detsum;
+    if (det >= errbound || -det >= errbound) {
+        return det;
+    }
+    return orient2dAdapt(pa, pb, pc, detsum);
+}
+
+inline int signOf(double v) {
+    return v > 0.0 ? 1 : (v < 0.0 ? -1 : 0);
+}
+
+//the planar predicates drop the biggest coordinate of the normal, the
+//projection keeps the orientation up to the sign of that coordinate
+inline int dropAxis(const AcGeVector3d& normal, int& u, int& v) {
+    int axis = 0;
+    if (std::abs(normal.y) > std::abs(normal[axis])) {
+        axis = 1;
+    }
+    if (std::abs(normal.z) > std::abs(normal[axis])) {
+        axis = 2;
+    }
+    u = (axis + 1) % 3;
+    v = (axis + 2) % 3;
+    return normal[axis] < 0 ? -1 : 1;
+}
+
+//sign of ((b - a) x (c - a)) . normal for points of one plane, 1 when c is
+//left of ab seen from the normal side
+int orientInPlane(const AcGePoint3d& a, const AcGePoint3d& b, const AcGePoint3d& c, const AcGeVector3d& normal) {
+    int u, v;
+    int s = dropAxis(normal, u, v);
+    double pa[2] = { a[u], a[v] };
+    double pb[2] = { b[u], b[v] };
+    double pc[2] = { c[u], c[v] };
+    return s * signOf(orient2d(pa, pb, pc));
+}
+
+//orientInPlane with c snapped onto the line ab, 0 when c lies within the
+//weld tolerance of it
+int orientSnapped(const AcGePoint3d& a, const AcGePoint3d& b, const AcGePoint3d& c, const AcGeVector3d& normal) {
+    AcGeVector3d ab = b - a;
+    double area = ab.crossProduct(c - a).dotProduct(normal);
+    if (std::abs(area) <= AcGeContext::gTol.equalPoint() * ab.length() * normal.length()) {
+        return 0;
+    }
+    return orientInPlane(a, b, c, normal);
+}
+
+//sign of (dir x (p - o)) . normal, the side of p against the line through o
+//along dir. dir is exact here, so the fallback sums four exact products
+int sideOfLine(const AcGePoint3d& o, const AcGeVector3d& dir, const AcGePoint3d& p, const AcGeVector3d& normal) {
+    int u, v;
+    int s = dropAxis(normal, u, v);
+    double left = dir[u] * (p[v] - o[v]);
+    double right = dir[v] * (p[u] - o[u]);
+    double det = left - right;
+    if (std::abs(det) > ccwErrBoundA * (std::abs(left) + std::abs(right))) {
+        return s * signOf(det);
+    }
+    double a[4] = { dir[u], -dir[u], -dir[v], dir[v] };
+    double b[4] = { p[v], o[v], p[u], o[u] };
+    double sum[8], next[8], term[2];
+    twoProduct(a[0], b[0], sum[1], sum[0]);
+    int length = 2;
+    for (int i = 1; i < 4; i++) {
+        twoProduct(a[i], b[i], term[1], term[0]);
+        length = expansionSum(length, sum, 2, term, next);
+        std::copy(next, next + length, sum);
+    }
+    return s * signOf(sum[length - 1]);
+}
+
 enum intersectStatus {
     change = 1,
     unknow = 0,
@@ -2644,19 +3414,50 @@ struct intersectPt
     double param;
 };
 
+//buffers of the point-in-loop kernels. every thread has its own set, the
+//kernels clear them instead of allocating, so once they have grown to the
+//biggest loop a classification pass does no heap allocation
+struct loopScratch {
+    AcGeDoubleArray params;
+    AcArray<bool> isOns;
+    AcGeVector3dArray vs;
+    AcGeVector3dArray vsCross;
+    AcGeDoubleArray vsCrossLength;
+    AcGeIntArray sides;//sideOfLine of every loop vertex
+    std::vector<intersectPt> arr;
+    //empties the per loop buffers, arr is cleared by its user
+    void reset() {
+        params.setLogicalLength(0);
+        isOns.setLogicalLength(0);
+        vs.setLogicalLength(0);
+        vsCross.setLogicalLength(0);
+        vsCrossLength.setLogicalLength(0);
+        sides.setLogicalLength(0);
+    }
+};
+
+loopScratch& threadScratch() {
+    thread_local loopScratch scratch;
+    return scratch;
+}
+
 void test(AcGeLine3d& l, std::vector<intersectPt>& arr, face& fa) {
     AcGePoint3d linePt = l.pointOnLine();
     AcGeVector3d lineDir = l.direction();
+    loopScratch& scratch = threadScratch();
     for (auto& loop : fa.loops) {
-        AcGeDoubleArray params(loop.length());
-        AcArray<bool> isOns(loop.length());
-        AcGeVector3dArray vs(loop.length());
-        AcGeVector3dArray vsCross(loop.length());
-        AcGeDoubleArray vsCrossLength(loop.length());
+        scratch.reset();
+        AcGeDoubleArray& params = scratch.params;
+        AcArray<bool>& isOns = scratch.isOns;
+        AcGeVector3dArray& vs = scratch.vs;
+        AcGeVector3dArray& vsCross = scratch.vsCross;
+        AcGeDoubleArray& vsCrossLength = scratch.vsCrossLength;
+        AcGeIntArray& sides = scratch.sides;
         for (int i = 0; i < loop.length(); i++) {
             vs.append(fa.pts[loop[i]] - linePt);
             vsCross.append(vs.last().crossProduct(lineDir));
             vsCrossLength.append(vsCross.last().length());
+            sides.append(sideOfLine(linePt, lineDir, fa.pts[loop[i]], fa.normal));
             params.append((vs.last()).dotProduct(lineDir));
             if ((linePt + lineDir * params.last()).isEqualTo(fa.pts[loop[i]])) {
                 isOns.append(true);
@@ -2679,7 +3480,7 @@ void test(AcGeLine3d& l, std::vector<intersectPt>& arr, face& fa) {
                 if (isOns[next] || isOns[prev]) {//β㣬ǰλǰΪغ϶
                     arr.push_back({ unknow ,fa.pts[loop[i]], params[i] });
                 }
-                else if (vsCross[i].dotProduct(vsCross[prev]) > 0) {//һ
+                else if (sides[i] * sides[prev] > 0) {//һ
                     arr.push_back({ unchange ,fa.pts[loop[i]], params[i] });
                 }
                 else {
@@ -2687,7 +3488,7 @@ void test(AcGeLine3d& l, std::vector<intersectPt>& arr, face& fa) {
                 }
             }
             else if(!isOns[next]){//һڲ
-                if (vsCross[i].dotProduct(vsCross[next]) < 0) {//ڲ㣬˵ֲ
+                if (sides[i] * sides[next] < 0) {//ڲ㣬˵ֲ
                     //ڲ
                     if (vsCrossLength[i] + vsCrossLength[next] < 1e-10) {
                         arr.push_back({ change ,linePt, 0 });
@@ -2731,16 +3532,11 @@ void mergeTwoArr(AcGeDoubleArray& arr1, AcGeDoubleArray& arr2, AcGeDoubleArray&
     }
 }
 
-AcArray<edge> planefaceIntersect(AcGePlane& pa, face& fb) {
-    AcGePlane pb(fb.pts[fb.loops[0][0]], fb.normal);
-    AcGeLine3d l;
+//pieces of the line l inside fb, directed along l
+AcArray<edge> lineFaceIntersect(AcGeLine3d& l, face& fb) {
     AcArray<edge> edgeRet;
-    if (!pa.intersectWith(pb, l)) {
-        return edgeRet;
-    }
-    AcGePoint3d p0 = l.evalPoint(1);
-    AcGePoint3d p1 = l.evalPoint(2);
-    std::vector<intersectPt> arr2;
+    std::vector<intersectPt>& arr2 = threadScratch().arr;
+    arr2.clear();
     test(l, arr2, fb);
     std::sort(arr2.begin(), arr2.end(), [](intersectPt& i, intersectPt& j) {return i.param < j.param; });
     Edgelocate lastLocate = out;
@@ -2786,34 +3582,126 @@ AcArray<edge> planefaceIntersect(AcGePlane& pa, face& fb) {
     return edgeRet;
 }
 
-AcArray<AcArray<edge>> detectLoop(std::list<edge>& edges) {
+//called with every chain detectLoop could not close, before it is dropped
+typedef void (*openChainHook)(const AcArray<edge>& chain);
+
+//edge start points hashed by cell, cells are 1024 tolerances wide so that a
+//lookup only probes a neighbour cell when the point lies within tolerance
+//of a cell wall
+struct endpointMap {
+    struct cellKey {
+        long long x, y, z;
+        bool operator==(const cellKey& other) const {
+            return x == other.x && y == other.y && z == other.z;
+        }
+    };
+    struct cellHash {
+        size_t operator()(const cellKey& k) const {
+            return size_t((unsigned long long)k.x * 73856093ULL ^ (unsigned long long)k.y * 19349663ULL ^ (unsigned long long)k.z * 83492791ULL);
+        }
+    };
+    double tol;
+    double cellSize;
+    std::unordered_map<cellKey, int, cellHash> heads;//first edge in the cell
+    AcGeIntArray nextInCell;//ascending chain of edges per cell
+
+    endpointMap(const AcArray<edge>& edges) {
+        tol = AcGeContext::gTol.equalPoint();
+        cellSize = tol * 1024;
+        heads.reserve(edges.length());
+        nextInCell.setLogicalLength(edges.length());
+        for (int i = edges.length() - 1; i >= 0; i--) {
+            cellKey key = keyOf(edges[i].start);
+            auto iter = heads.find(key);
+            nextInCell[i] = iter == heads.end() ? -1 : iter->second;
+            heads[key] = i;
+        }
+    }
+    cellKey keyOf(const AcGePoint3d& pt) const {
+        return cellKey{ (long long)floor(pt.x / cellSize), (long long)floor(pt.y / cellSize), (long long)floor(pt.z / cellSize) };
+    }
+    //smallest unused edge whose start is equal to pt, -1 if none
+    int find(const AcGePoint3d& pt, const AcArray<edge>& edges, const AcArray<bool>& used) {
+        cellKey center = keyOf(pt);
+        long long lo[3], hi[3];
+        for (int c = 0; c < 3; c++) {
+            double offset = pt[c] - floor(pt[c] / cellSize) * cellSize;
+            lo[c] = offset < tol ? -1 : 0;
+            hi[c] = cellSize - offset < tol ? 1 : 0;
+        }
+        int best = -1;
+        for (long long dx = lo[0]; dx <= hi[0]; dx++) {
+            for (long long dy = lo[1]; dy <= hi[1]; dy++) {
+                for (long long dz = lo[2]; dz <= hi[2]; dz++) {
+                    auto iter = heads.find(cellKey{ center.x + dx, center.y + dy, center.z + dz });
+                    if (iter == heads.end()) {
+                        continue;
+                    }
+                    //drop consumed edges from the front of the chain
+                    while (iter->second >= 0 && used[iter->second]) {
+                        iter->second = nextInCell[iter->second];
+                    }
+                    for (int i = iter->second; i >= 0 && (best < 0 || i < best); i = nextInCell[i]) {
+                        if (!used[i] && edges[i].start.isEqualTo(pt)) {
+                            best = i;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+        return best;
+    }
+};
+
+AcArray<AcArray<edge>> detectLoop(std::list<edge>& edgeList, openChainHook hook = nullptr) {
     AcArray<AcArray<edge>> rets;
     AcArray<edge> ret;
-    while (edges.size() > 0) {
+    AcArray<edge> edges(int(edgeList.size()));
+    for (auto& e : edgeList) {
+        edges.append(e);
+    }
+    edgeList.clear();
+    endpointMap map(edges);
+    AcArray<bool> used;
+    used.setLogicalLength(edges.length());
+    used.setAll(false);
+    int remaining = edges.length();
+    int first = 0;//edges before first are all used
+    while (remaining > 0) {
         if (ret.length() == 0) {
-            ret.append(*edges.begin());
-            edges.pop_front();
+            while (used[first]) {
+                first++;
+            }
+            ret.append(edges[first]);
+            used[first] = true;
+            remaining--;
         }
         if (ret.length() > 2 && ret[0].start.isEqualTo(ret.last().end)) {
             rets.append(ret);
             ret.setLogicalLength(0);
             continue;
         }
-        bool find = false;
-        for (std::list<edge>::iterator start = edges.begin(); start != edges.end(); ) {
-            if ((*start).start.isEqualTo(ret.last().end)) {
-                ret.append(*start);
-                edges.erase(start);
-                find = true;
-                break;
-            }
-            start++;
+        int next = map.find(ret.last().end, edges, used);
+        if (next >= 0) {
+            ret.append(edges[next]);
+            used[next] = true;
+            remaining--;
         }
-        if (!find) {
-            ret.setLogicalLength(0);//δɻ
+        else {
+            if (hook) {
+                hook(ret);
+            }
+            ret.setLogicalLength(0);
         }
-        if (edges.size() == 0 && ret.length() > 2) {
-            rets.append(ret);
+        //the last chain is closed or handed to the hook like any other
+        if (remaining == 0 && ret.length() > 0) {
+            if (ret.length() > 2 && ret[0].start.isEqualTo(ret.last().end)) {
+                rets.append(ret);
+            }
+            else if (hook) {
+                hook(ret);
+            }
         }
     }
     return rets;
@@ -2833,7 +3721,7 @@ struct intersectInfo {
     }
 };
 
-AcArray<face*> loopsToFaces(AcArray<AcGePoint3dArray>& loops, AcGeVector3d& normal);
+AcArray<face*> loopsToFaces(AcArray<AcGePoint3dArray>& loops, AcGeVector3d& normal, booleanArena& arena);
 
 void faceToPts(face& f, AcGePoint3dArray& pts, AcGeIntArray& loopbool, AcGeIntArray& loopPre, bool bReverse) {
     for (auto& loop : f.loops) {
@@ -2861,17 +3749,22 @@ void invertArr(AcGeIntArray& arr, AcGeIntArray& ret) {
 
 //㣨ߣfaĵloopIndexloopİϵ
 bool ptInLoop3(const AcGePoint3d& linePt, AcGeVector3d& lineDir, face& fa, int loopIndex, bool onAsIn = false) {
-    std::vector<intersectPt> arr;
+    loopScratch& scratch = threadScratch();
+    std::vector<intersectPt>& arr = scratch.arr;
+    arr.clear();
     auto& loop = fa.loops[loopIndex];
-    AcGeDoubleArray params(loop.length());
-    AcArray<bool> isOns(loop.length());
-    AcGeVector3dArray vs(loop.length());
-    AcGeVector3dArray vsCross(loop.length());
-    AcGeDoubleArray vsCrossLength(loop.length());
+    scratch.reset();
+    AcGeDoubleArray& params = scratch.params;
+    AcArray<bool>& isOns = scratch.isOns;
+    AcGeVector3dArray& vs = scratch.vs;
+    AcGeVector3dArray& vsCross = scratch.vsCross;
+    AcGeDoubleArray& vsCrossLength = scratch.vsCrossLength;
+    AcGeIntArray& sides = scratch.sides;
     for (int i = 0; i < loop.length(); i++) {
         vs.append(fa.pts[loop[i]] - linePt);
         vsCross.append(vs.last().crossProduct(lineDir));
         vsCrossLength.append(vsCross.last().length());
+        sides.append(sideOfLine(linePt, lineDir, fa.pts[loop[i]], fa.normal));
         params.append((vs.last()).dotProduct(lineDir));
         if (params.last() > 0 && (linePt + lineDir * params.last()).isEqualTo(fa.pts[loop[i]])) {
             isOns.append(true);
@@ -2895,20 +3788,20 @@ bool ptInLoop3(const AcGePoint3d& linePt, AcGeVector3d& lineDir, face& fa, int l
                 continue;
             }
             else if (isOns[next]) {//ǰΪغ϶
-                bool bLeft = vsCross[prev].dotProduct(fa.normal) > 0;
+                bool bLeft = sides[prev] < 0;
                 arr.push_back({ rightUnknow ,fa.pts[loop[i]], params[i] });
                 if (bLeft) {
                     arr[arr.size() - 1].status = leftUnknow;
                 }
             }
             else if (isOns[prev]) {//ǰΪغ϶
-                bool bLeft = vsCross[next].dotProduct(fa.normal) > 0;
+                bool bLeft = sides[next] < 0;
                 arr.push_back({ rightUnknow ,fa.pts[loop[i]], params[i] });
                 if (bLeft) {
                     arr[arr.size() - 1].status = leftUnknow;
                 }
             }
-            else if (vsCross[i].dotProduct(vsCross[prev]) > 0) {//һ
+            else if (sides[i] * sides[prev] > 0) {//һ
                 arr.push_back({ unchange ,fa.pts[loop[i]], params[i] });
             }
             else {
@@ -2916,7 +3809,7 @@ bool ptInLoop3(const AcGePoint3d& linePt, AcGeVector3d& lineDir, face& fa, int l
             }
         }
         else if (!isOns[next]) {//һڲ
-            if (vsCross[i].dotProduct(vsCross[next]) < 0) {//ڲ㣬˵ֲ
+            if (sides[i] * sides[next] < 0) {//ڲ㣬˵ֲ
                 //ڲ
                 double param = vs[i].crossProduct(vs[next]).length() / (vsCrossLength[i] + vsCrossLength[next]);
                 if ((vs[i] + vs[next]).dotProduct(lineDir) > 0) {
@@ -2961,17 +3854,22 @@ bool ptInLoop3(const AcGePoint3d& linePt, AcGeVector3d& lineDir, face& fa, int l
 }
 
 bool ptInLoop2(const AcGePoint3d& linePt, AcGeVector3d& lineDir, face& fa) {
-    std::vector<intersectPt> arr;
+    loopScratch& scratch = threadScratch();
+    std::vector<intersectPt>& arr = scratch.arr;
+    arr.clear();
     for (auto& loop : fa.loops) {
-        AcGeDoubleArray params(loop.length());
-        AcArray<bool> isOns(loop.length());
-        AcGeVector3dArray vs(loop.length());
-        AcGeVector3dArray vsCross(loop.length());
-        AcGeDoubleArray vsCrossLength(loop.length());
+        scratch.reset();
+        AcGeDoubleArray& params = scratch.params;
+        AcArray<bool>& isOns = scratch.isOns;
+        AcGeVector3dArray& vs = scratch.vs;
+        AcGeVector3dArray& vsCross = scratch.vsCross;
+        AcGeDoubleArray& vsCrossLength = scratch.vsCrossLength;
+        AcGeIntArray& sides = scratch.sides;
         for (int i = 0; i < loop.length(); i++) {
             vs.append(fa.pts[loop[i]] - linePt);
             vsCross.append(vs.last().crossProduct(lineDir));
             vsCrossLength.append(vsCross.last().length());
+            sides.append(sideOfLine(linePt, lineDir, fa.pts[loop[i]], fa.normal));
             params.append((vs.last()).dotProduct(lineDir));
             if (params.last() > 0 && (linePt + lineDir * params.last()).isEqualTo(fa.pts[loop[i]])) {
                 isOns.append(true);
@@ -2994,7 +3892,7 @@ bool ptInLoop2(const AcGePoint3d& linePt, AcGeVector3d& lineDir, face& fa) {
                 if (isOns[next] || isOns[prev]) {//β㣬ǰλǰΪغ϶
                     arr.push_back({ unknow ,fa.pts[loop[i]], params[i] });
                 }
-                else if (vsCross[i].dotProduct(vsCross[prev]) > 0) {//һ
+                else if (sides[i] * sides[prev] > 0) {//һ
                     arr.push_back({ unchange ,fa.pts[loop[i]], params[i] });
                 }
                 else {
@@ -3002,7 +3900,7 @@ bool ptInLoop2(const AcGePoint3d& linePt, AcGeVector3d& lineDir, face& fa) {
                 }
             }
             else if (!isOns[next]) {//һڲ
-                if (vsCross[i].dotProduct(vsCross[next]) < 0) {//ڲ㣬˵ֲ
+                if (sides[i] * sides[next] < 0) {//ڲ㣬˵ֲ
                     //ڲ
                     double param = vs[i].crossProduct(vs[next]).length() / (vsCrossLength[i] + vsCrossLength[next]);
                     if ((vs[i] + vs[next]).dotProduct(lineDir) > 0) {
@@ -3038,7 +3936,8 @@ bool ptInLoop2(const AcGePoint3d& linePt, AcGeVector3d& lineDir, face& fa) {
 
 //
 bool ptInLoop(const AcGePoint3d& pt, AcGeVector3d& dir, AcGePoint3dArray& pts, AcArray<bool>& loop) {
-    AcGeVector3dArray vs(pts.length());
+    AcGeVector3dArray& vs = threadScratch().vs;
+    vs.setLogicalLength(0);
     for (int i = 0; i < pts.length(); i++) {
         vs.append(pts[i] - pt);
     }
@@ -3098,6 +3997,15 @@ enum loopLoopPosition {
     outab
 };
 
+//boxes of every loop of f
+void loopBoxesOf(face& f, AcArray<loopBox>& boxes) {
+    boxes.setLogicalLength(f.loops.length());
+    for (int i = 0; i < f.loops.length(); i++) {
+        boxes[i] = loopBox();
+        extendBox(f.pts.asArrayPtr(), f.loops[i].asArrayPtr(), f.loops[i].length(), boxes[i].min, boxes[i].max);
+    }
+}
+
 loopLoopPosition judgeFaceALoopWithFaceBLoop(face& fa, int aIndex, face& fb, int bIndex) {
     bool position1 = ptInLoop3(fa.pts[fa.loops[aIndex][0]], fa.normal.perpVector(), fb, bIndex);
     if (position1)
@@ -3143,13 +4051,16 @@ struct loopTreeNode
         nodeLoop = other.nodeLoop;
         return *this;
     }
+    size_t heapBytes() const {
+        return nodeLoop.capacity() * sizeof(loopTreeNode*);
+    }
     int curLoop;
     std::vector<loopTreeNode*> nodeLoop;
 
 };
 
-loopTreeNode* loopsToTree(AcArray<AcGeIntArray>& loops, int numOfFa) {
-    loopTreeNode* ret = new loopTreeNode();
+loopTreeNode* loopsToTree(AcArray<AcGeIntArray>& loops, int numOfFa, booleanArena& arena) {
+    loopTreeNode* ret = arena.make<loopTreeNode>();
     AcArray<loopTreeNode*> deque;
     if (loops[0].length() == 0) {//a⻷Ϊroot
         ret->curLoop = 1;
@@ -3173,12 +4084,12 @@ loopTreeNode* loopsToTree(AcArray<AcGeIntArray>& loops, int numOfFa) {
                     childrenTree.insert(loops[i].last());
                 }
                 else {
-                    cur->nodeLoop.emplace_back(new loopTreeNode(i < numOfFa ? i + 1 : -(i - numOfFa + 1)));
+                    cur->nodeLoop.emplace_back(arena.make<loopTreeNode>(i < numOfFa ? i + 1 : -(i - numOfFa + 1)));
                 }
             }
         }
         for (auto& child : childrenTree) {
-            cur->nodeLoop.emplace_back(new loopTreeNode(child));
+            cur->nodeLoop.emplace_back(arena.make<loopTreeNode>(child));
             deque.append(cur->nodeLoop[cur->nodeLoop.size() - 1]);
         }
     }
@@ -3199,7 +4110,7 @@ void faceLoopCopyToFace(face& fa, int index, face& target, bool reverse) {
     target.loops.append(loop);
 }
 
-AcArray<face*> facefaceWithNoIntersectPts2(face& fa, face& fb, AcGePoint3dArray& faPts, AcGePoint3dArray& fbPts, bool bInner) {
+AcArray<face*> facefaceWithNoIntersectPts2(face& fa, face& fb, AcGePoint3dArray& faPts, AcGePoint3dArray& fbPts, bool bInner, booleanArena& arena) {
     AcArray<face*> ret;
     //֮Ҫжϰ n*m
     AcArray<AcGeIntArray> loops;
@@ -3220,13 +4131,28 @@ AcArray<face*> facefaceWithNoIntersectPts2(face& fa, face& fb, AcGePoint3dArray&
         }
         loops[i + fa.loops.length()] = temp;
     }
+    //loops whose boxes are apart by more than the weld tolerance are outab
+    //without a point test, loops that touch within it still get the test
+    const double tol = AcGeContext::gTol.equalPoint();
+    const AcGeVector3d inflate(tol, tol, tol);
+    AcArray<loopBox> boxesA, boxesB;
+    loopBoxesOf(fa, boxesA);
+    loopBoxesOf(fb, boxesB);
+    for (int i = 0; i < boxesA.length(); i++) {
+        boxesA[i].min -= inflate;
+        boxesA[i].max += inflate;
+    }
     bool breakJ0 = false;
     for (int i = 0; i < fa.loops.length(); i++) {
+        unsigned long long mask = 0;
         for (int j = 0; j < fb.loops.length(); j++) {
+            if (j % 64 == 0) {
+                mask = overlapMask(boxesB.asArrayPtr() + j, std::min(64, fb.loops.length() - j), boxesA[i].min, boxesA[i].max);
+            }
             if (j == 0 && breakJ0) {
                 continue;
             }
-            loopLoopPosition pos = judgeFaceALoopWithFaceBLoop(fa, i, fb, j);
+            loopLoopPosition pos = (mask >> (j % 64) & 1) ? judgeFaceALoopWithFaceBLoop(fa, i, fb, j) : outab;
             if (i == 0 && j == 0) {
                 if (pos == outab) {
                     return ret;
@@ -3247,7 +4173,7 @@ AcArray<face*> facefaceWithNoIntersectPts2(face& fa, face& fb, AcGePoint3dArray&
             else if (i == 0) {
                 if (pos == aInb){
                     if (!bInner) {
-                        ret.append(new face(fb));
+                        ret.append(arena.make<face>(fb));
                     }
                     return ret;
                 }
@@ -3261,7 +4187,7 @@ AcArray<face*> facefaceWithNoIntersectPts2(face& fa, face& fb, AcGePoint3dArray&
                 }
                 else if (pos == bIna) {
                     if (!bInner) {
-                        ret.append(new face(fb));
+                        ret.append(arena.make<face>(fb));
                     }
                     return ret;
                 }
@@ -3277,15 +4203,15 @@ AcArray<face*> facefaceWithNoIntersectPts2(face& fa, face& fb, AcGePoint3dArray&
         }
     }
     //ݰϵɽ
-    loopTreeNode* root = loopsToTree(loops, fa.loops.length());//Ĳ
+    loopTreeNode* root = loopsToTree(loops, fa.loops.length(), arena);//Ĳ
     if (bInner){//abĲ
         for (auto& node : root->nodeLoop) {
             if (node->curLoop * root->curLoop < 0) {
                 if (node->nodeLoop.size() == 0) {
-                    ret.append(new face(root->curLoop > 0 ? fb : fa));
+                    ret.append(arena.make<face>(root->curLoop > 0 ? fb : fa));
                     return ret;
                 }
-                face* tempRet = new face();
+                face* tempRet = arena.make<face>();
                 faceLoopCopyToFace(node->curLoop > 0 ? fa : fb, abs(node->curLoop) - 1, *tempRet, false);
                 for (auto& node2 : node->nodeLoop) {
                     faceLoopCopyToFace(node2->curLoop > 0 ? fa : fb, abs(node2->curLoop) - 1, *tempRet, false);
@@ -3296,7 +4222,7 @@ AcArray<face*> facefaceWithNoIntersectPts2(face& fa, face& fb, AcGePoint3dArray&
     }
     else {//abĲ
         if (root->curLoop > 0) {
-            face* tempRet = new face();
+            face* tempRet = arena.make<face>();
             faceLoopCopyToFace(fa, 0, *tempRet, false);
             for (auto& node : root->nodeLoop) {
                 faceLoopCopyToFace(node->curLoop > 0 ? fa : fb, abs(node->curLoop) - 1, *tempRet, node->curLoop < 0);
@@ -3310,7 +4236,7 @@ AcArray<face*> facefaceWithNoIntersectPts2(face& fa, face& fb, AcGePoint3dArray&
                     if (node3->curLoop > 0) {
                         continue;
                     }
-                    face* tempRet = new face();
+                    face* tempRet = arena.make<face>();
                     faceLoopCopyToFace(fb, abs(node3->curLoop) - 1, *tempRet, true);
                     if (node3->nodeLoop.size() > 0) {
                         faceLoopCopyToFace(fa, abs(node3->nodeLoop[0]->curLoop) - 1, *tempRet, false);
@@ -3326,7 +4252,7 @@ AcArray<face*> facefaceWithNoIntersectPts2(face& fa, face& fb, AcGePoint3dArray&
                 }
                 for (auto& node2 : node->nodeLoop) {
                     if (node->curLoop * node2->curLoop < 0) {
-                        face* tempRet = new face();
+                        face* tempRet = arena.make<face>();
                         faceLoopCopyToFace(node2->curLoop > 0 ? fa : fb, abs(node2->curLoop) - 1, *tempRet, node->curLoop < 0);
                         if (node2->nodeLoop.size() > 0) {
                             faceLoopCopyToFace(fa, abs(node2->nodeLoop[0]->curLoop) - 1, *tempRet, false);
@@ -3341,7 +4267,7 @@ AcArray<face*> facefaceWithNoIntersectPts2(face& fa, face& fb, AcGePoint3dArray&
     return ret;
 }
 
-AcArray<face*> facefaceWithNoIntersectPts(face& fa, face& fb, AcGePoint3dArray& faPts, AcGePoint3dArray& fbPts, bool bInner) {
+AcArray<face*> facefaceWithNoIntersectPts(face& fa, face& fb, AcGePoint3dArray& faPts, AcGePoint3dArray& fbPts, bool bInner, booleanArena& arena) {
     if (!fa.bBox) {
         fa.caculateBox();
     }
@@ -3355,11 +4281,11 @@ AcArray<face*> facefaceWithNoIntersectPts(face& fa, face& fb, AcGePoint3dArray&
         //faܰfb
         if (ptInLoop2(fb.pts[0], fb.normal.perpVector(), fa)) {
             if (bInner) {
-                ret.append(new face(fb));
+                ret.append(arena.make<face>(fb));
             }
             else {
                 //fafbķ
-                face* temp = new face(fa);
+                face* temp = arena.make<face>(fa);
                 int ptsLen = temp->pts.length();
                 temp->pts.append(fb.pts);
                 AcGeIntArray loop = fb.loops[0];
@@ -3379,7 +4305,7 @@ AcArray<face*> facefaceWithNoIntersectPts(face& fa, face& fb, AcGePoint3dArray&
         (fa.min.z > fb.min.z && fa.max.z < fb.max.z)) {
         if (ptInLoop2(fa.pts[0], fa.normal.perpVector(), fb)) {
             if (bInner) {
-                ret.append(new face(fa));
+                ret.append(arena.make<face>(fa));
             }
         }
     }
@@ -3391,10 +4317,13 @@ void dealWithCoLine(AcGePoint3d& p0,AcGeVector3d& vq0p0, AcGeVector3d& vq0p1, Ac
     const AcGePoint3d& qpre, const AcGeVector3d& faNormal, const AcGePoint3d& ppre, bool bInner)
 {
     //뽻loopbıҪloopa
-    if (vq0p0.dotProduct(vq0p1) < 0 && vq0p1.lengthSqrd() > 1e-20) {
+    //the sides are exact, points within the weld tolerance count as equal
+    //and vertices within it of an edge as on its line
+    AcGePoint3d p1 = p0 + vp;
+    AcGePoint3d q1 = q0 + vq;
+    if (vq0p0.dotProduct(vq0p1) < 0 && !q0.isEqualTo(p0) && !q0.isEqualTo(p1)) {
         //q0Ϊ
-        AcGeVector3d area = vp.crossProduct(qpre - p0);
-        if (area.dotProduct(faNormal) > 1e-10) {
+        if (orientSnapped(p0, p1, qpre, faNormal) > 0) {
             double pam = vq0p0.length() / vp.length();
             intersection_Point.append(intersectInfo(pam + i, j, !vp.isCodirectionalTo(vq), q0));
             if (!bInner)
@@ -3403,12 +4332,11 @@ void dealWithCoLine(AcGePoint3d& p0,AcGeVector3d& vq0p0, AcGeVector3d& vq0p1, Ac
             }
         } 
     }
-    if (vq0p0.dotProduct(vp0q1) > 0 && vp0q1.lengthSqrd() > 1e-20) {
+    if (vq0p0.dotProduct(vp0q1) > 0 && !p0.isEqualTo(q0) && !p0.isEqualTo(q1)) {
         //p0Ϊ
         if (vp.isCodirectionalTo(vq)) {
             //q0Ҫλpprep0
-            AcGeVector3d area = vq0p0.crossProduct(p0 - ppre);
-            if (area.dotProduct(faNormal) > 1e-10) {
+            if (orientSnapped(p0, q0, ppre, faNormal) > 0) {
                 double pam = vq0p0.length() / vq.length();
                 intersection_Point.append(intersectInfo(i, j + pam, false, p0));
                 if (!bInner)
@@ -3419,8 +4347,7 @@ void dealWithCoLine(AcGePoint3d& p0,AcGeVector3d& vq0p0, AcGeVector3d& vq0p1, Ac
         }
         else {
             //q1Ҫλpprep0
-            AcGeVector3d area = vp0q1.crossProduct(ppre - p0);
-            if (area.dotProduct(faNormal) > 1e-10) {
+            if (orientSnapped(p0, q1, ppre, faNormal) > 0) {
                 double pam = vq0p0.length() / vq.length();
                 intersection_Point.append(intersectInfo(i, j + pam, true, p0));
                 if (!bInner)
@@ -3431,11 +4358,10 @@ void dealWithCoLine(AcGePoint3d& p0,AcGeVector3d& vq0p0, AcGeVector3d& vq0p1, Ac
         }
         
     }
-    if (vq0p0.isZeroLength()) {
+    if (p0.isEqualTo(q0)) {
         //p0q0غ
         if (vp.isCodirectionalTo(vq)) {
-            AcGeVector3d area = (p0 - ppre).crossProduct(qpre - ppre);
-            if (area.dotProduct(faNormal) > 1e-10) {
+            if (orientSnapped(ppre, p0, qpre, faNormal) > 0) {
                 //intersection_Point.append(intersectInfo(i, j, bout, q0));
                 intersection_Point.append(intersectInfo(i, j, false, q0));
                 if (!bInner)
@@ -3528,112 +4454,483 @@ void getNextArrFor(AcArray<intersectInfo>& intersection_Point, AcGeIntArray& int
     }
 }
 
-AcArray<face*> facefaceIntersect(face& fa, face& fb, bool bInner) {//faΪΣfbΪüΡڲü
-    //fafbΪ,Ϊ໷
-    AcGePoint3dArray datap0;
-    AcGePoint3dArray dataq0;
-    AcGeIntArray loop0, loop1;//ǰһ
-    AcGeIntArray loop0Pre, loop1Pre;//ǰһ
-    faceToPts(fa, datap0, loop0, loop0Pre, false); faceToPts(fb, dataq0, loop1, loop1Pre, !bInner);
-    AcArray<intersectInfo> intersection_Point;
-    for (int i = 0; i < datap0.length(); i++) {
-        for (int j = 0; j < dataq0.length(); j++) {
-            AcGePoint3d& p0 = datap0[i];
-            AcGePoint3d& p1 = datap0[loop0[i]];
-            AcGePoint3d& q0 = dataq0[j];
-            AcGePoint3d& q1 = dataq0[loop1[j]];
-            AcGeVector3d vp = p1 - p0;
-            AcGeVector3d vp0q1 = q1 - p0;
-            AcGeVector3d v1 = vp.crossProduct(q0 - p0);
-            AcGeVector3d v2 = vp.crossProduct(q1 - p0);
-            if (v1.dotProduct(v2) > 0.0) {
-                continue;
-            }
-            AcGeVector3d vq = q1 - q0;
-            AcGeVector3d vq0p0 = p0 - q0;
-            AcGeVector3d vq0p1 = p1 - q0;
-            AcGeVector3d u1 = vq.crossProduct(p0 - q0);
-            AcGeVector3d u2 = vq.crossProduct(p1 - q0);
-            if (u1.dotProduct(u2) > 0.0) {
-                continue;
-            }
-            bool bout = true;
-            if (u2.dotProduct(fa.normal) > 0) {
-                bout = false;
-            }
-            AcGeVector3d e1e2 = vp.crossProduct(vq);
-            if (e1e2.lengthSqrd() < 1e-20) {
-                dealWithCoLine(p0, vq0p0, vq0p1, vp0q1, q0, intersection_Point, i, j, bout, vp, vq, dataq0[loop1Pre[j]], fa.normal, datap0[loop0Pre[i]], bInner);
-                continue;
-            }
-            if (v2.lengthSqrd() < 1e-20 && vp0q1.dotProduct(p1 - q1) >= 0.0) {//q1Ϊ
-                continue;
-            }
-            if (u2.lengthSqrd() < 1e-20 && vq0p1.dotProduct(q1 - p1) >= 0.0) {//p1
-                continue;
-            }
-            double pam1 = (p0 - q0).crossProduct(vq).length() / e1e2.length();
-            double pam2 = (p0 + pam1 * vp).distanceTo(q0) / vq.length();
-            if (pam1 < 1e-10 && pam2 < 1e-10) {
-                AcGeVector3d vpPre = datap0[loop0Pre[i]] - p0;
-                AcGeVector3d vqPre = dataq0[loop1Pre[j]] - q0;
-                if (vpPre.isCodirectionalTo(vqPre) || vqPre.isCodirectionalTo(vp)) {
-                    double angle1 = vp0q1.angleTo(vpPre, fa.normal);
-                    double angle2 = vp.angleTo(vpPre, fa.normal);
-                    if (angle1 > angle2) {
-                        continue;
+//uniform grid over the edges of one face, built in the plane of the face.
+//facefaceIntersect uses it to pick the edges of fb whose boxes overlap an
+//edge of fa, so the orientation tests only run on those pairs
+struct edgeGrid {
+    int axisU = 0;
+    int axisV = 1;
+    int numU = 0;
+    int numV = 0;
+    double originU = 0.0;
+    double originV = 0.0;
+    double cellSize = 1.0;
+    double pad = 0.0;
+    int numEdges = 0;
+    AcGeIntArray cellStart;//cellEdges[cellStart[c]..cellStart[c+1]) are the edges in cell c
+    AcGeIntArray cellEdges;
+    AcGeDoubleArray boxes;//minU, maxU, minV, maxV per edge, padded
+    AcGeIntArray stamp;
+    int curStamp = 0;
+    static const int minPairs = 64;//below this the plain double loop is cheaper
+
+    void edgeBox(const AcGePoint3d& p0, const AcGePoint3d& p1, double& minU, double& maxU, double& minV, double& maxV) const {
+        minU = std::min(p0[axisU], p1[axisU]); maxU = std::max(p0[axisU], p1[axisU]);
+        minV = std::min(p0[axisV], p1[axisV]); maxV = std::max(p0[axisV], p1[axisV]);
+    }
+    int cellU(double u) const {
+        return std::min(numU - 1, std::max(0, int(floor((u - originU) / cellSize))));
+    }
+    int cellV(double v) const {
+        return std::min(numV - 1, std::max(0, int(floor((v - originV) / cellSize))));
+    }
+    //pts[i]-pts[next[i]] are the edges, normal is the plane of the face
+    void build(const AcGePoint3dArray& pts, const AcGeIntArray& next, const AcGeVector3d& normal, int numQueries) {
+        numEdges = pts.length();
+        numU = numV = 0;
+        if (numEdges * numQueries < minPairs) {
+            return;
+        }
+        //drop the dominant axis of the normal
+        int axisW = 2;
+        if (std::abs(normal.x) >= std::abs(normal.y) && std::abs(normal.x) >= std::abs(normal.z)) {
+            axisW = 0;
+        }
+        else if (std::abs(normal.y) >= std::abs(normal.z)) {
+            axisW = 1;
+        }
+        axisU = (axisW + 1) % 3;
+        axisV = (axisW + 2) % 3;
+        double minU = maxDouble, maxU = minDouble, minV = maxDouble, maxV = minDouble;
+        for (auto& p : pts) {
+            minU = std::min(minU, p[axisU]); maxU = std::max(maxU, p[axisU]);
+            minV = std::min(minV, p[axisV]); maxV = std::max(maxV, p[axisV]);
+        }
+        double extentU = maxU - minU, extentV = maxV - minV;
+        pad = AcGeContext::gTol.equalPoint() + 1e-9 * (extentU + extentV);
+        double area = extentU * extentV;
+        if (area > 1e-20) {
+            cellSize = sqrt(area / numEdges);
+        }
+        else {
+            cellSize = std::max(extentU, extentV) / numEdges;
+        }
+        if (cellSize < 1e-10) {
+            cellSize = 1.0;
+        }
+        originU = minU;
+        originV = minV;
+        numU = std::min(1024, int(extentU / cellSize) + 1);
+        numV = std::min(1024, int(extentV / cellSize) + 1);
+        boxes.setLogicalLength(4 * numEdges);
+        for (int i = 0; i < numEdges; i++) {
+            edgeBox(pts[i], pts[next[i]], boxes[4 * i], boxes[4 * i + 1], boxes[4 * i + 2], boxes[4 * i + 3]);
+            boxes[4 * i] -= pad; boxes[4 * i + 1] += pad;
+            boxes[4 * i + 2] -= pad; boxes[4 * i + 3] += pad;
+        }
+        //counting pass then fill pass
+        cellStart.setLogicalLength(numU * numV + 1);
+        cellStart.setAll(0);
+        for (int pass = 0; pass < 2; pass++) {
+            for (int i = 0; i < numEdges; i++) {
+                int u0 = cellU(boxes[4 * i]), u1 = cellU(boxes[4 * i + 1]);
+                int v0 = cellV(boxes[4 * i + 2]), v1 = cellV(boxes[4 * i + 3]);
+                for (int u = u0; u <= u1; u++) {
+                    for (int v = v0; v <= v1; v++) {
+                        if (pass == 0) {
+                            cellStart[u * numV + v + 1]++;
+                        }
+                        else {
+                            cellEdges[stamp[u * numV + v]++] = i;
+                        }
                     }
                 }
-                else if (vpPre.isCodirectionalTo(vq)) {
-                    double angle1 = vqPre.angleTo(vpPre, fa.normal);
-                    double angle2 = vp.angleTo(vpPre, fa.normal);
-                    if (angle1 > angle2) {
-                        continue;
-                    }
+            }
+            if (pass == 0) {
+                for (int c = 0; c < numU * numV; c++) {
+                    cellStart[c + 1] += cellStart[c];
                 }
+                cellEdges.setLogicalLength(cellStart.last());
+                stamp.setLogicalLength(numU * numV);//fill cursor per cell
+                for (int c = 0; c < numU * numV; c++) {
+                    stamp[c] = cellStart[c];
+                }
+            }
+        }
+        stamp.setLogicalLength(numEdges);
+        stamp.setAll(0);
+        curStamp = 0;
+    }
+    //edges whose box overlaps the box of p0-p1, ascending
+    void query(const AcGePoint3d& p0, const AcGePoint3d& p1, AcGeIntArray& ret) {
+        ret.setLogicalLength(0);
+        if (numU == 0) {
+            for (int j = 0; j < numEdges; j++) {
+                ret.append(j);
             }
-            else if (pam1 < 1e-10) {
-                AcGeVector3d vpPre = datap0[loop0Pre[i]] - p0;
-                if (vpPre.isCodirectionalTo(vq)) {//p0λq0q1֮
-                    AcGeVector3d area = vp.crossProduct(q0 - p0);
-                    if (area.dotProduct(fa.normal) < 1e-10) {
+            return;
+        }
+        double minU, maxU, minV, maxV;
+        edgeBox(p0, p1, minU, maxU, minV, maxV);
+        curStamp++;
+        int u0 = cellU(minU), u1 = cellU(maxU);
+        int v0 = cellV(minV), v1 = cellV(maxV);
+        for (int u = u0; u <= u1; u++) {
+            for (int v = v0; v <= v1; v++) {
+                int c = u * numV + v;
+                for (int k = cellStart[c]; k < cellStart[c + 1]; k++) {
+                    int j = cellEdges[k];
+                    if (stamp[j] == curStamp) {
                         continue;
                     }
-                }
-                else if (vpPre.isCodirectionalTo(-vq)) {
-                    AcGeVector3d area = vp.crossProduct(vp0q1);
-                    if (area.dotProduct(fa.normal) < 1e-10) {
+                    stamp[j] = curStamp;
+                    if (boxes[4 * j] > maxU || boxes[4 * j + 1] < minU || boxes[4 * j + 2] > maxV || boxes[4 * j + 3] < minV) {
                         continue;
                     }
+                    ret.append(j);
                 }
             }
-            else if (pam2 < 1e-10) {
-                AcGeVector3d vqPre = dataq0[loop1Pre[j]] - q0;
-                if (vqPre.isParallelTo(vp)) {//q0λp0p1֮
-                    AcGeVector3d area = vp.crossProduct(vp0q1);
-                    if (area.dotProduct(fa.normal) < 1e-10) {//غϽ㴦üָⲿ˶غ
-                        continue;
-                    }
+        }
+        std::sort(ret.begin(), ret.end());
+    }
+};
+
+//the edges of one face projected like orientInPlane, as structure of
+//arrays. filter() runs the straddle rejection of facefaceIntersect on a
+//whole candidate list, 4 edges at a time with AVX2. it only drops a pair
+//when the double determinants are certain of the sign, so the exact
+//predicates see every pair that may still cross
+struct edgeBlock {
+    int axisU = 0;
+    int axisV = 1;
+    std::vector<double> x0, y0, x1, y1;
+
+    //pts[i]-pts[next[i]] are the edges, normal is the plane of the face
+    void build(const AcGePoint3dArray& pts, const AcGeIntArray& next, const AcGeVector3d& normal) {
+        dropAxis(normal, axisU, axisV);
+        int n = pts.length();
+        x0.resize(n); y0.resize(n); x1.resize(n); y1.resize(n);
+        for (int i = 0; i < n; i++) {
+            x0[i] = pts[i][axisU];
+            y0[i] = pts[i][axisV];
+            x1[i] = pts[next[i]][axisU];
+            y1[i] = pts[next[i]][axisV];
+        }
+    }
+    //certain sign of orient2d(a, b, c): 1, -1, or 0 when the filter fails
+    static int certainOrient(double ax, double ay, double bx, double by, double cx, double cy) {
+        double left = (ax - cx) * (by - cy);
+        double right = (ay - cy) * (bx - cx);
+        double det = left - right;
+        double bound = ccwErrBoundA * (std::abs(left) + std::abs(right));
+        return det > bound ? 1 : (det < -bound ? -1 : 0);
+    }
+    bool rejects(double px0, double py0, double px1, double py1, int j) const {
+        int v1 = certainOrient(px0, py0, px1, py1, x0[j], y0[j]);
+        int v2 = certainOrient(px0, py0, px1, py1, x1[j], y1[j]);
+        if (v1 * v2 > 0) {
+            return true;
+        }
+        int u1 = certainOrient(x0[j], y0[j], x1[j], y1[j], px0, py0);
+        int u2 = certainOrient(x0[j], y0[j], x1[j], y1[j], px1, py1);
+        return u1 * u2 > 0;
+    }
+#if defined(ASDK_AVX2)
+    //masks of the lanes where orient2d(a, b, c) is certainly positive, negative
+    ASDK_AVX2_TARGET static void certainOrient4(__m256d ax, __m256d ay, __m256d bx, __m256d by, __m256d cx, __m256d cy, __m256d& pos, __m256d& neg) {
+        const __m256d signBit = _mm256_set1_pd(-0.0);
+        __m256d left = _mm256_mul_pd(_mm256_sub_pd(ax, cx), _mm256_sub_pd(by, cy));
+        __m256d right = _mm256_mul_pd(_mm256_sub_pd(ay, cy), _mm256_sub_pd(bx, cx));
+        __m256d det = _mm256_sub_pd(left, right);
+        __m256d bound = _mm256_mul_pd(_mm256_set1_pd(ccwErrBoundA),
+            _mm256_add_pd(_mm256_andnot_pd(signBit, left), _mm256_andnot_pd(signBit, right)));
+        pos = _mm256_cmp_pd(det, bound, _CMP_GT_OQ);
+        neg = _mm256_cmp_pd(det, _mm256_xor_pd(bound, signBit), _CMP_LT_OQ);
+    }
+    //filter over the first count / 4 * 4 candidates, moves the kept ones to
+    //the front of cand. returns how many it took, the kept count in kept
+    ASDK_AVX2_TARGET int filterAvx2(double px0, double py0, double px1, double py1, int* cand, int count, int& kept) const {
+        int k = 0;
+        __m256d ax = _mm256_set1_pd(px0), ay = _mm256_set1_pd(py0);
+        __m256d bx = _mm256_set1_pd(px1), by = _mm256_set1_pd(py1);
+        for (; k + 4 <= count; k += 4) {
+            __m128i index = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cand + k));
+            __m256d qx0 = _mm256_i32gather_pd(x0.data(), index, 8);
+            __m256d qy0 = _mm256_i32gather_pd(y0.data(), index, 8);
+            __m256d qx1 = _mm256_i32gather_pd(x1.data(), index, 8);
+            __m256d qy1 = _mm256_i32gather_pd(y1.data(), index, 8);
+            __m256d pos1, neg1, pos2, neg2, pos3, neg3, pos4, neg4;
+            certainOrient4(ax, ay, bx, by, qx0, qy0, pos1, neg1);
+            certainOrient4(ax, ay, bx, by, qx1, qy1, pos2, neg2);
+            certainOrient4(qx0, qy0, qx1, qy1, ax, ay, pos3, neg3);
+            certainOrient4(qx0, qy0, qx1, qy1, bx, by, pos4, neg4);
+            __m256d reject = _mm256_or_pd(
+                _mm256_or_pd(_mm256_and_pd(pos1, pos2), _mm256_and_pd(neg1, neg2)),
+                _mm256_or_pd(_mm256_and_pd(pos3, pos4), _mm256_and_pd(neg3, neg4)));
+            int mask = _mm256_movemask_pd(reject);
+            for (int lane = 0; lane < 4; lane++) {
+                if (!(mask & (1 << lane))) {
+                    cand[kept++] = cand[k + lane];
                 }
             }
-            intersection_Point.append(intersectInfo(pam1 + i, pam2 + j, bout, p0 + (p1 - p0) * pam1));
+        }
+        return k;
+    }
+#endif
+    //removes the edges of candidates that certainly do not straddle p0-p1
+    void filter(const AcGePoint3d& p0, const AcGePoint3d& p1, AcGeIntArray& candidates) const {
+        double px0 = p0[axisU], py0 = p0[axisV], px1 = p1[axisU], py1 = p1[axisV];
+        int* cand = candidates.asArrayPtr();
+        int count = candidates.length();
+        int kept = 0;
+        int k = 0;
+#if defined(ASDK_AVX2)
+        if (hasAvx2()) {
+            k = filterAvx2(px0, py0, px1, py1, cand, count, kept);
+        }
+#endif
+        for (; k < count; k++) {
+            if (!rejects(px0, py0, px1, py1, cand[k])) {
+                cand[kept++] = cand[k];
+            }
+        }
+        candidates.setLogicalLength(kept);
+    }
+};
+
+//the crossing of edge i = p0-p1 of fa with edge j = q0-q1 of fb, whose lines
+//straddle each other by the exact predicates. ppre, qpre are the vertices
+//before p0, q0 and side1 is orientInPlane(q0, q1, p1). the branches take
+//the exact sides of the vertices against the other edge, with a vertex
+//within the weld tolerance of the other line snapped onto it, so it takes
+//the vertex and collinear branches whatever its exact side. true when the
+//pair came near one of those branches, they depend on the direction of fb.
+//otherwise the pair gave one crossing, and with fb reversed it crosses at
+//the same point the other way
+bool crossEdges(AcGePoint3d& p0, AcGePoint3d& p1, const AcGePoint3d& ppre, AcGePoint3d& q0, AcGePoint3d& q1, const AcGePoint3d& qpre,
+    int i, int j, int side1, const AcGeVector3d& normal, bool bInner, AcArray<intersectInfo>& intersection_Point) {
+    AcGeVector3d vp = p1 - p0;
+    AcGeVector3d vp0q1 = q1 - p0;
+    AcGeVector3d vq = q1 - q0;
+    AcGeVector3d vq0p0 = p0 - q0;
+    AcGeVector3d vq0p1 = p1 - q0;
+    bool bout = side1 <= 0;
+    AcGeVector3d e1e2 = vp.crossProduct(vq);
+    int sideQ0 = orientSnapped(p0, p1, q0, normal);
+    int sideQ1 = orientSnapped(p0, p1, q1, normal);
+    int sideP0 = orientSnapped(q0, q1, p0, normal);
+    int sideP1 = orientSnapped(q0, q1, p1, normal);
+    if ((sideQ0 == 0 && sideQ1 == 0) || (sideP0 == 0 && sideP1 == 0)) {
+        dealWithCoLine(p0, vq0p0, vq0p1, vp0q1, q0, intersection_Point, i, j, bout, vp, vq, qpre, normal, ppre, bInner);
+        return true;
+    }
+    if (sideQ1 == 0 && (vp0q1.dotProduct(p1 - q1) >= 0.0 || q1.isEqualTo(p0) || q1.isEqualTo(p1))) {//q1Ϊ
+        return true;
+    }
+    if (sideP1 == 0 && (vq0p1.dotProduct(q1 - p1) >= 0.0 || p1.isEqualTo(q0) || p1.isEqualTo(q1))) {//p1
+        return true;
+    }
+    double pam1 = (p0 - q0).crossProduct(vq).length() / e1e2.length();
+    double pam2 = (p0 + pam1 * vp).distanceTo(q0) / vq.length();
+    //the reversed pair swaps q0 and q1 and negates the sides of p0, p1.
+    //with no vertex on the other line, side1 == 0 included, neither
+    //direction takes a degenerate branch. the snap is relative to the
+    //tolerance, so this holds at any coordinate size
+    bool degenerate = sideP0 == 0 || sideP1 == 0 || sideQ0 == 0 || sideQ1 == 0;
+    if (sideP0 == 0 && sideQ0 == 0) {
+        AcGeVector3d vpPre = ppre - p0;
+        AcGeVector3d vqPre = qpre - q0;
+        if (vpPre.isCodirectionalTo(vqPre) || vqPre.isCodirectionalTo(vp)) {
+            double angle1 = vp0q1.angleTo(vpPre, normal);
+            double angle2 = vp.angleTo(vpPre, normal);
+            if (angle1 > angle2) {
+                return true;
+            }
+        }
+        else if (vpPre.isCodirectionalTo(vq)) {
+            double angle1 = vqPre.angleTo(vpPre, normal);
+            double angle2 = vp.angleTo(vpPre, normal);
+            if (angle1 > angle2) {
+                return true;
+            }
         }
     }
-    if (0 == intersection_Point.length()) {
-        return facefaceWithNoIntersectPts2(fa, fb, datap0, dataq0, bInner);
+    else if (sideP0 == 0) {
+        AcGeVector3d vpPre = ppre - p0;
+        if (vpPre.isCodirectionalTo(vq)) {//p0λq0q1֮
+            if (sideQ0 <= 0) {
+                return true;
+            }
+        }
+        else if (vpPre.isCodirectionalTo(-vq)) {
+            if (sideQ1 <= 0) {
+                return true;
+            }
+        }
+    }
+    else if (sideQ0 == 0) {
+        AcGeVector3d vqPre = qpre - q0;
+        if (vqPre.isParallelTo(vp)) {//q0λp0p1֮
+            if (sideQ1 <= 0) {//غϽ㴦üָⲿ˶غ
+                return true;
+            }
+        }
     }
+    intersection_Point.append(intersectInfo(pam1 + i, pam2 + j, bout, p0 + (p1 - p0) * pam1));
+    return degenerate;
+}
+
+//intersection graph of the boundaries of fa and fb, one per face pair. the
+//inner clip walks fb forwards, the outer clip backwards, numbered like
+//faceToPts with bReverse. the exact tests run once for both walks, and the
+//outer walk only gets its own linking when a degenerate pair made the two
+//walks cross at different points
+struct clipGraph {
+    AcGePoint3dArray datap0;
+    AcGeIntArray loop0;//ǰһ
+    AcGeIntArray loop0Pre;//ǰһ
+    struct walk {
+        AcGePoint3dArray dataq0;
+        AcGeIntArray loop1, loop1Pre;
+        AcArray<intersectInfo> intersection_Point;
+        AcGeIntArray intersection_Pointa, intersection_Pointb;//the points sorted along fa, fb
+        AcGeIntArray intersection_PointaNext, intersection_PointbNext;
+    };
+    walk walks[2];//inner, outer
+};
+
+//sorts the points of w along fa and fb and links them
+void linkClipPoints(clipGraph::walk& w, face& fa, face& fb) {
+    AcArray<intersectInfo>& intersection_Point = w.intersection_Point;
+    AcGeIntArray& intersection_Pointa = w.intersection_Pointa;
+    AcGeIntArray& intersection_Pointb = w.intersection_Pointb;
+    AcGeIntArray& intersection_PointaNext = w.intersection_PointaNext;
+    AcGeIntArray& intersection_PointbNext = w.intersection_PointbNext;
     //array,ֱfafb
-    AcGeIntArray intersection_Pointa;
     int numOfIntsect = intersection_Point.length();
     for (int i = 0; i < numOfIntsect; i++) {
         intersection_Pointa.append(i);
     }
-    AcGeIntArray intersection_Pointb = intersection_Pointa;
+    intersection_Pointb = intersection_Pointa;
     std::sort(intersection_Pointa.begin(), intersection_Pointa.end(), [&](const int& a, const int& b) {return intersection_Point[a].p1 < intersection_Point[b].p1; });
     std::sort(intersection_Pointb.begin(), intersection_Pointb.end(), [&](const int& a, const int& b) {return intersection_Point[a].p2 < intersection_Point[b].p2; });
     //
-    AcGeIntArray intersection_PointaNext, intersection_PointbNext;
     getNextArrFor(intersection_Point, intersection_Pointa, intersection_Pointb, intersection_PointaNext, intersection_PointbNext, fa, fb);
+}
+
+//the crossings of the edges of fa with the edges of fb. the grid and the
+//straddle filter pick the candidate edges of fb for every edge of fa, the
+//exact tests run on those
+void buildClipGraph(face& fa, face& fb, clipGraph& graph) {
+    AcGePoint3dArray& datap0 = graph.datap0;
+    AcGeIntArray& loop0 = graph.loop0;
+    AcGeIntArray& loop0Pre = graph.loop0Pre;
+    clipGraph::walk& inner = graph.walks[0];
+    clipGraph::walk& outer = graph.walks[1];
+    AcGePoint3dArray& dataq0 = inner.dataq0;
+    AcGeIntArray& loop1 = inner.loop1;
+    AcGeIntArray& loop1Pre = inner.loop1Pre;
+    faceToPts(fa, datap0, loop0, loop0Pre, false);
+    faceToPts(fb, dataq0, loop1, loop1Pre, false);
+    faceToPts(fb, outer.dataq0, outer.loop1, outer.loop1Pre, true);
+    //vertex v of a loop is vertex start + n - 1 - (v - start) of the reversed loop
+    AcGeIntArray reversedVertex;
+    for (auto& loop : fb.loops) {
+        int start = reversedVertex.length(), n = loop.length();
+        for (int k = 0; k < n; k++) {
+            reversedVertex.append(start + n - 1 - k);
+        }
+    }
+    edgeGrid gridq;
+    gridq.build(dataq0, loop1, fa.normal, datap0.length());
+    edgeBlock blockq;
+    blockq.build(dataq0, loop1, fa.normal);
+    AcGeIntArray candidates;
+    bool mirrored = true;
+    for (int i = 0; i < datap0.length(); i++) {
+        gridq.query(datap0[i], datap0[loop0[i]], candidates);
+        blockq.filter(datap0[i], datap0[loop0[i]], candidates);
+        for (int j : candidates) {
+            AcGePoint3d& p0 = datap0[i];
+            AcGePoint3d& p1 = datap0[loop0[i]];
+            AcGePoint3d& q0 = dataq0[j];
+            AcGePoint3d& q1 = dataq0[loop1[j]];
+            //the straddle tests read the same for fb reversed
+            if (orientInPlane(p0, p1, q0, fa.normal) * orientInPlane(p0, p1, q1, fa.normal) > 0) {
+                continue;
+            }
+            int side1 = orientInPlane(q0, q1, p1, fa.normal);
+            if (orientInPlane(q0, q1, p0, fa.normal) * side1 > 0) {
+                continue;
+            }
+            //edge j reversed runs from q1 to q0 and starts at the reversed q1
+            int reversedEdge = reversedVertex[loop1[j]];
+            int count = inner.intersection_Point.length();
+            if (crossEdges(p0, p1, datap0[loop0Pre[i]], q0, q1, dataq0[loop1Pre[j]], i, j, side1, fa.normal, true, inner.intersection_Point)) {
+                mirrored = false;
+                crossEdges(p0, p1, datap0[loop0Pre[i]], q1, q0, dataq0[loop1[loop1[j]]], i, reversedEdge, -side1, fa.normal, false, outer.intersection_Point);
+                continue;
+            }
+            for (int k = count; k < inner.intersection_Point.length(); k++) {
+                intersectInfo pt = inner.intersection_Point[k];
+                pt.p2 = reversedEdge + 1.0 - (pt.p2 - j);
+                pt.bOut = !pt.bOut;
+                outer.intersection_Point.append(pt);
+            }
+        }
+    }
+    linkClipPoints(inner, fa, fb);
+    if (!mirrored) {
+        linkClipPoints(outer, fa, fb);
+        return;
+    }
+    //the outer points are the inner ones in the same order: the same order
+    //along fa, the opposite along fb
+    outer.intersection_Pointa = inner.intersection_Pointa;
+    outer.intersection_PointaNext = inner.intersection_PointaNext;
+    outer.intersection_Pointb = inner.intersection_Pointb;
+    outer.intersection_PointbNext.setLogicalLength(inner.intersection_PointbNext.length());
+    for (int k = 0; k < inner.intersection_PointbNext.length(); k++) {
+        outer.intersection_PointbNext[inner.intersection_PointbNext[k]] = k;
+    }
+}
+
+AcArray<face*> clipFace(face& fa, face& fb, bool bInner, clipGraph& graph, booleanArena& arena);
+
+//fa clipped by fb, bInner keeps the part inside fb, otherwise the part outside
+AcArray<face*> facefaceIntersect(face& fa, face& fb, bool bInner, booleanArena& arena) {
+    clipGraph graph;
+    buildClipGraph(fa, fb, graph);
+    return clipFace(fa, fb, bInner, graph, arena);
+}
+
+//both clips of fa by fb from one intersection graph, the part inside fb
+//goes to inner, the part outside to outer
+void facefaceClip(face& fa, face& fb, AcArray<face*>& inner, AcArray<face*>& outer, booleanArena& arena) {
+    clipGraph graph;
+    buildClipGraph(fa, fb, graph);
+    inner.append(clipFace(fa, fb, true, graph, arena));
+    outer.append(clipFace(fa, fb, false, graph, arena));
+}
+
+AcArray<face*> clipFace(face& fa, face& fb, bool bInner, clipGraph& graph, booleanArena& arena) {//faΪΣfbΪüΡڲü
+    //fafbΪ,Ϊ໷
+    clipGraph::walk& w = graph.walks[bInner ? 0 : 1];
+    if (0 == w.intersection_Point.length()) {
+        return facefaceWithNoIntersectPts2(fa, fb, graph.datap0, w.dataq0, bInner, arena);
+    }
+    AcGePoint3dArray& datap0 = graph.datap0;
+    AcGePoint3dArray& dataq0 = w.dataq0;
+    AcGeIntArray& loop0 = graph.loop0;
+    AcGeIntArray& loop1 = w.loop1;
+    AcGeIntArray& loop0Pre = graph.loop0Pre;
+    AcGeIntArray& loop1Pre = w.loop1Pre;
+    AcArray<intersectInfo>& intersection_Point = w.intersection_Point;
+    AcGeIntArray& intersection_Pointa = w.intersection_Pointa;
+    AcGeIntArray& intersection_Pointb = w.intersection_Pointb;
+    AcGeIntArray& intersection_PointaNext = w.intersection_PointaNext;
+    AcGeIntArray& intersection_PointbNext = w.intersection_PointbNext;
+    int numOfIntsect = intersection_Point.length();
 
     //ά
     AcGeIntArray oTob;
@@ -3705,12 +5002,12 @@ AcArray<face*> facefaceIntersect(face& fa, face& fb, bool bInner) {//faΪ
     if (ret.length() > 0) {
         rets.append(ret);
     }
-    return loopsToFaces(rets, fa.normal);
+    return loopsToFaces(rets, fa.normal, arena);
 }
 
 #include "geblok3d.h"
 
-AcArray<face*> loopsToFaces(AcArray<AcGePoint3dArray>& loops, AcGeVector3d& normal)
+AcArray<face*> loopsToFaces(AcArray<AcGePoint3dArray>& loops, AcGeVector3d& normal, booleanArena& arena)
 {
     AcArray<AcGeBoundBlock3d> blocks;
     blocks.setLogicalLength(loops.length());
@@ -3720,11 +5017,10 @@ AcArray<face*> loopsToFaces(AcArray<AcGePoint3dArray>& loops, AcGeVector3d& norm
     loopDirct.setLogicalLength(loops.length()); vistited.setLogicalLength(loops.length());
     loopDirct.setAll(true); vistited.setAll(false);
     for (int i = 0; i < loops.length(); i++) {
-        AcGeBoundBlock3d& block = blocks[i];
-        for (auto& pt : loops[i]) {
-            block.extend(pt);
-        }
-        block.getMinMaxPoints(blockMinPt[i], blockMaxPt[i]);
+        blockMinPt[i] = AcGePoint3d(maxDouble, maxDouble, maxDouble);
+        blockMaxPt[i] = AcGePoint3d(minDouble, minDouble, minDouble);
+        extendBox(loops[i].asArrayPtr(), loops[i].length(), blockMinPt[i], blockMaxPt[i]);
+        blocks[i].set(blockMinPt[i], blockMaxPt[i]);
         AcGeVector3d normaltemp;
         for (int j = 0; j < loops[i].length(); j++) {
             if (j == loops[i].length() - 1) {
@@ -3755,7 +5051,7 @@ AcArray<face*> loopsToFaces(AcArray<AcGePoint3dArray>& loops, AcGeVector3d& norm
                 vistited[j] = true;
             }
         }
-        face* f = new face();
+        face* f = arena.make<face>();
         f->normal = normal;
         for (auto& pts : ret) {
             AcGeIntArray loop;
@@ -3765,39 +5061,228 @@ AcArray<face*> loopsToFaces(AcArray<AcGePoint3dArray>& loops, AcGeVector3d& norm
             f->pts.append(pts);
             f->loops.append(loop);
         }
+        f->caculatePlane();
         rets.append(f);
     }
     return rets;
 }
 
-AcArray<face*> AinB;
-AcArray<face*> AoutB;
-AcArray<face*> BinA;
-AcArray<face*> BoutA;
+//state of one boolean operation. booleanOperation owns one per call, so
+//several booleans can run at the same time
+struct booleanContext {
+    booleanArena arena;//owns every face and loop tree node of the operation
+    AcArray<face*> AinB;
+    AcArray<face*> AoutB;
+    AcArray<face*> BinA;
+    AcArray<face*> BoutA;
+    openChainHook chainHook = nullptr;//may be called from several threads
+    int numThreads = 0;//worker threads, 0 uses every hardware thread
+};
+
 template<class T1, class T2>
 bool encounter(const T1& t1, const T2& t2) {
-    for (int i = 0; i < 3; i++) {
-        if (t1.min[i] > t2.max[i] || t1.max[i] < t2.min[i]) {
+    return boxesOverlap(t1.min, t1.max, t2.min, t2.max);
+}
+
+//bounding volume hierarchy over the face boxes of one operand.
+//only faces whose box straddles the plane of fa can contribute a segment
+//to the section of b, so faceBodyIntersect queries by plane instead of
+//scanning every face of b
+struct faceBVH {
+    struct node {
+        AcGePoint3d min = AcGePoint3d(maxDouble, maxDouble, maxDouble);
+        AcGePoint3d max = AcGePoint3d(minDouble, minDouble, minDouble);
+        int left = -1;//children, -1 for leaf
+        int right = -1;
+        int start = 0;//range in faceIndex for leaf
+        int count = 0;
+    };
+    AcArray<node> nodes;
+    AcGeIntArray faceIndex;
+    const body* bd = nullptr;
+    static const int leafSize = 4;
+
+    void build(body& b) {
+        bd = &b;
+        nodes.setLogicalLength(0);
+        faceIndex.setLogicalLength(b.faces.length());
+        for (int i = 0; i < b.faces.length(); i++) {
+            if (!b.faces[i]->bBox) {
+                b.faces[i]->caculateBox();
+            }
+            faceIndex[i] = i;
+        }
+        if (b.faces.length() > 0) {
+            nodes.setPhysicalLength(2 * (b.faces.length() / leafSize + 1));
+            buildNode(0, b.faces.length());
+        }
+    }
+    int buildNode(int start, int end) {
+        int index = nodes.append(node());
+        node cur;
+        cur.start = start;
+        cur.count = end - start;
+        for (int i = start; i < end; i++) {
+            const face& f = *bd->faces[faceIndex[i]];
+            for (int c = 0; c < 3; c++) {
+                cur.min[c] = std::min(cur.min[c], f.min[c]);
+                cur.max[c] = std::max(cur.max[c], f.max[c]);
+            }
+        }
+        if (end - start > leafSize) {
+            int axis = 0;
+            for (int c = 1; c < 3; c++) {
+                if (cur.max[c] - cur.min[c] > cur.max[axis] - cur.min[axis]) {
+                    axis = c;
+                }
+            }
+            int mid = (start + end) / 2;
+            const body* b = bd;
+            std::nth_element(faceIndex.begin() + start, faceIndex.begin() + mid, faceIndex.begin() + end, [&](int i, int j) {
+                return b->faces[i]->min[axis] + b->faces[i]->max[axis] < b->faces[j]->min[axis] + b->faces[j]->max[axis]; });
+            cur.left = buildNode(start, mid);
+            cur.right = buildNode(mid, end);
+        }
+        nodes[index] = cur;
+        return index;
+    }
+    //faces of bd whose box touches the plane (pt, normal), in the order of bd->faces
+    void queryPlane(const AcGePoint3d& pt, const AcGeVector3d& normal, AcGeIntArray& hits) const {
+        hits.setLogicalLength(0);
+        if (nodes.length() == 0) {
+            return;
+        }
+        const double tol = AcGeContext::gTol.equalPoint();
+        AcGeVector3d n = normal.normal();
+        AcGeIntArray stack;
+        stack.append(0);
+        while (stack.length() > 0) {
+            const node& cur = nodes[stack.last()];
+            stack.removeLast();
+            double radius = 0.0, dist = 0.0;
+            for (int c = 0; c < 3; c++) {
+                radius += 0.5 * (cur.max[c] - cur.min[c]) * std::abs(n[c]);
+                dist += (0.5 * (cur.max[c] + cur.min[c]) - pt[c]) * n[c];
+            }
+            if (std::abs(dist) > radius + tol) {
+                continue;
+            }
+            if (cur.left < 0) {
+                for (int i = cur.start; i < cur.start + cur.count; i++) {
+                    hits.append(faceIndex[i]);
+                }
+                continue;
+            }
+            stack.append(cur.left);
+            stack.append(cur.right);
+        }
+        std::sort(hits.begin(), hits.end());
+    }
+};
+
+//line of the planes of fa and fb, directed along na x nb like
+//AcGePlane::intersectWith. false when the planes are parallel
+inline bool planePlaneLine(const face& fa, const face& fb, AcGeLine3d& l) {
+    const AcGeVector3d& na = fa.planeNormal;
+    const AcGeVector3d& nb = fb.planeNormal;
+    AcGeVector3d dir = na.crossProduct(nb);
+    if (dir.isZeroLength()) {
+        return false;
+    }
+    double len2 = dir.lengthSqrd();
+    AcGeVector3d pt = (nb.crossProduct(dir) * -fa.planeD + dir.crossProduct(na) * -fb.planeD) * (1.0 / len2);
+    l.set(AcGePoint3d(pt.x, pt.y, pt.z), dir * (1.0 / sqrt(len2)));
+    return true;
+}
+
+//true when every point of f is farther than tol from the plane of fa on
+//the same side, the plane then cannot cut f
+bool planeMisses(const face& fa, const face& f, double tol) {
+    bool above = true, below = true;
+    for (auto& pt : f.pts) {
+        double dist = fa.planeDistance(pt);
+        above = above && dist > tol;
+        below = below && dist < -tol;
+        if (!above && !below) {
             return false;
         }
     }
     return true;
 }
 
-void faceBodyIntersect(face& fa, body& b, AcArray<face*>& ret, AcArray<face*>& ret2) {
+//plane-plane lines of the face pairs, shared by the two classification
+//passes. the a against b pass records the line of every pair it meets
+//under the face of a. flip() files them under the face of b with the
+//direction reversed, as pb.intersectWith(pa) gives it, and the b against a
+//pass picks them up by merging with its sorted candidates
+struct sectionLines {
+    struct entry {
+        int other;//index of the face in the other operand
+        bool parallel;
+        AcGePoint3d pt;
+        AcGeVector3d dir;
+    };
+    AcArray<AcArray<entry>> byFace;
+    bool recording = true;
+
+    sectionLines(int numFaces) {
+        byFace.setLogicalLength(numFaces);
+    }
+    void flip(int numOther) {
+        AcArray<AcArray<entry>> flipped;
+        flipped.setLogicalLength(numOther);
+        for (int i = 0; i < byFace.length(); i++) {
+            for (auto& e : byFace[i]) {
+                flipped[e.other].append(entry{ i, e.parallel, e.pt, -e.dir });
+            }
+        }
+        byFace = flipped;
+        recording = false;
+    }
+};
+
+//the section of b by the plane of fa, clipped to fa. index is the position
+//of fa in its body, the lines of its pairs are recorded or reused there
+void faceBodyIntersect(face& fa, int index, body& b, const faceBVH& bvh, sectionLines& lines, AcArray<face*>& ret, AcArray<face*>& ret2, openChainHook hook, booleanArena& arena) {
     if (!encounter(fa, b)) {
         ret2.append(&fa);
         return;
     }
     std::list<edge> intersLine;
-    AcGePlane pa(fa.pts[fa.loops[0][0]], fa.normal);
-    for (auto& fb : b.faces) {
-        AcArray<edge> interRet = planefaceIntersect(pa, *fb);
+    const double tol = AcGeContext::gTol.equalPoint();
+    AcGeIntArray candidates;
+    bvh.queryPlane(fa.pts[fa.loops[0][0]], fa.normal, candidates);
+    AcArray<sectionLines::entry>& known = lines.byFace[index];
+    int k = 0;
+    for (int j : candidates) {
+        face& fb = *b.faces[j];
+        if (planeMisses(fa, fb, tol)) {
+            continue;
+        }
+        AcGeLine3d l;
+        bool parallel;
+        while (!lines.recording && k < known.length() && known[k].other < j) {
+            k++;
+        }
+        if (!lines.recording && k < known.length() && known[k].other == j) {
+            parallel = known[k].parallel;
+            l.set(known[k].pt, known[k].dir);
+        }
+        else {
+            parallel = !planePlaneLine(fa, fb, l);
+            if (lines.recording) {
+                known.append(sectionLines::entry{ j, parallel, l.pointOnLine(), l.direction() });
+            }
+        }
+        if (parallel) {
+            continue;
+        }
+        AcArray<edge> interRet = lineFaceIntersect(l, fb);
         for (auto& edge : interRet) {
             intersLine.push_back(edge);
         }
     }
-    AcArray<AcArray<edge>> loops = detectLoop(intersLine);
+    AcArray<AcArray<edge>> loops = detectLoop(intersLine, hook);
     AcArray<AcGePoint3dArray> ptloops(loops.length());
     for (auto& loop : loops) {
         AcGePoint3dArray ptloop(loop.length());
@@ -3806,111 +5291,454 @@ void faceBodyIntersect(face& fa, body& b, AcArray<face*>& ret, AcArray<face*>& r
         }
         ptloops.append(ptloop);
     }
-    AcArray<face*> fbs = loopsToFaces(ptloops, fa.normal);
+    AcArray<face*> fbs = loopsToFaces(ptloops, fa.normal, arena);
+    for (auto& fb : fbs) {
+        fb->caculateBox();
+    }
+    //a face along an axis has a flat box, the section points are only
+    //within the weld tolerance of it
+    const AcGeVector3d inflate(tol, tol, tol);
+    const AcGePoint3d faMin = fa.min - inflate, faMax = fa.max + inflate;
+    unsigned long long mask = 0;
     for (int i = 0; i < fbs.length(); i++) {
-        ret.append(facefaceIntersect(fa, *fbs[i], true));
-        ret2.append(facefaceIntersect(fa, *fbs[i], false));
+        if (i % 64 == 0) {
+            mask = overlapMask(fbs.asArrayPtr() + i, std::min(64, fbs.length() - i), faMin, faMax);
+        }
+        //section face apart from fa by more than the tolerance, neither clip
+        //produces anything
+        if (!(mask >> (i % 64) & 1)) {
+            continue;
+        }
+        facefaceClip(fa, *fbs[i], ret, ret2, arena);
     }
 }
 
-enum boolType {
-    Union,
-    Intersect,
-    Subtruct
-};
+//number of workers parallelForWorkers runs
+int parallelWorkers(int count, int chunkSize, int numThreads) {
+    return std::max(1, std::min(numThreads, (count + chunkSize - 1) / chunkSize));
+}
 
-void caculateFace(body2& bd) {
-    std::vector<AcGeIntArray> vertexToFace;
-    std::vector<std::set<int>> faceToFace;
-    AcArray<AcGeIntArray> orderFace = bd.faces;
-    vertexToFace.resize(bd.pts.size());
-    for (int i = 0; i < bd.faces.length(); i++) {
-        for (auto v : bd.faces[i]) {
-            vertexToFace[v].append(i);
+//calls fn(worker, begin, end) for the chunks of [0, count), worker is the
+//index of the calling thread below parallelWorkers(). the worker threads
+//take one chunk at a time, the first exception thrown by fn is rethrown here
+template<class F>
+void parallelForWorkers(int count, int chunkSize, int numThreads, F fn) {
+    const int numChunks = (count + chunkSize - 1) / chunkSize;
+    std::atomic<int> nextChunk(0);
+    std::exception_ptr error;
+    std::atomic<bool> failed(false);
+    auto worker = [&](int index) {
+        try {
+            for (int c = nextChunk++; c < numChunks && !failed; c = nextChunk++) {
+                fn(index, c * chunkSize, std::min(count, (c + 1) * chunkSize));
+            }
         }
-    }
-    for (int i = 0; i < bd.faces.length(); i++) {
-        std::set<int> neighboorFace;
-        for (auto v : bd.faces[i]) {
-            for (auto f : vertexToFace[v]) {
-                neighboorFace.emplace(f);
+        catch (...) {
+            if (!failed.exchange(true)) {
+                error = std::current_exception();
             }
         }
-        faceToFace.push_back(neighboorFace);
+    };
+    std::vector<std::thread> threads;
+    for (int t = 1; t < parallelWorkers(count, chunkSize, numThreads); t++) {
+        threads.emplace_back(worker, t);
+    }
+    worker(0);
+    for (auto& t : threads) {
+        t.join();
     }
-    for (auto& f : orderFace) {
-        std::sort(f.begin(), f.end());
+    if (error) {
+        std::rethrow_exception(error);
     }
-    for (int i = 0; i < bd.faces.length(); i++) {
-        for (auto f : faceToFace[i]) {
-            if (i == f) {
+}
+
+//calls fn(begin, end) for the chunks of [0, count)
+template<class F>
+void parallelFor(int count, int chunkSize, int numThreads, F fn) {
+    parallelForWorkers(count, chunkSize, numThreads, [&](int, int begin, int end) {
+        fn(begin, end);
+    });
+}
+
+//faceBodyIntersect for every face of a against b. every chunk of faces
+//writes its own output arrays and the chunks are merged in order, so the
+//result is the same for any thread count. every worker allocates from its
+//own arena, the worker arenas are merged into arena at the end
+void classifyFaces(body& a, body& b, const faceBVH& bvhB, sectionLines& lines, AcArray<face*>& in, AcArray<face*>& out, openChainHook hook, booleanArena& arena, int numThreads) {
+    const int chunkSize = 16;
+    const int numChunks = (a.faces.length() + chunkSize - 1) / chunkSize;
+    AcArray<AcArray<face*>> chunkIn, chunkOut;
+    chunkIn.setLogicalLength(numChunks);
+    chunkOut.setLogicalLength(numChunks);
+    std::vector<booleanArena> workerArenas(parallelWorkers(a.faces.length(), chunkSize, numThreads));
+    parallelForWorkers(a.faces.length(), chunkSize, numThreads, [&](int worker, int begin, int end) {
+        int c = begin / chunkSize;
+        for (int i = begin; i < end; i++) {
+            faceBodyIntersect(*a.faces[i], i, b, bvhB, lines, chunkIn[c], chunkOut[c], hook, workerArenas[worker]);
+        }
+    });
+    for (auto& workerArena : workerArenas) {
+        arena.merge(workerArena);
+    }
+    for (int c = 0; c < numChunks; c++) {
+        in.append(chunkIn[c]);
+        out.append(chunkOut[c]);
+    }
+}
+
+//direction of the i-th ray of ptInBody: three fixed skew directions, then
+//points of a golden angle spiral over the sphere
+AcGeVector3d rayDirection(int i) {
+    static const AcGeVector3d dirs[] = {
+        AcGeVector3d(0.5773, 0.5789, 0.5760).normal(),
+        AcGeVector3d(-0.3127, 0.7411, 0.5943).normal(),
+        AcGeVector3d(0.8117, -0.2293, -0.5371).normal()
+    };
+    if (i < 3) {
+        return dirs[i];
+    }
+    double z = 1.0 - 2.0 * fmod(i * 0.6180339887498949 + 0.1234, 1.0);
+    double r = sqrt(std::max(0.0, 1.0 - z * z));
+    double phi = i * 2.399963229728653 + 0.5;
+    return AcGeVector3d(r * cos(phi), r * sin(phi), z);
+}
+
+//ray casting point-in-body test. a ray that hits a face plane edge-on or
+//passes close to an edge is thrown away and the next direction is tried.
+//distances are compared against the weld tolerance scaled up to the size
+//of the body. if every ray is degenerate the parities of all of them vote
+bool ptInBody(const AcGePoint3d& pt, body& b) {
+    const int maxRays = 32;
+    const double angleTol = 1e-6;
+    const double tol = std::max(AcGeContext::gTol.equalPoint(), 1e-9 * b.min.distanceTo(b.max));
+    int votesIn = 0;
+    for (int ray = 0; ray < maxRays; ray++) {
+        AcGeVector3d dir = rayDirection(ray);
+        int count = 0;
+        bool clean = true;
+        for (int i = 0; i < b.faces.length(); i++) {
+            face& f = *b.faces[i];
+            double denom = f.normal.dotProduct(dir);
+            double dist = f.normal.dotProduct(f.pts[f.loops[0][0]] - pt);
+            if (fabs(denom) < angleTol) {
+                clean = clean && fabs(dist) > tol;
                 continue;
             }
-            faceToFace[f].erase(i);
-            if (bd.faces[i].length() != bd.faces[f].length()) {
+            double param = dist / denom;
+            if (param <= 0) {
                 continue;
             }
-            if (orderFace[i] == orderFace[f]) {
+            AcGePoint3d hit = pt + dir * param;
+            bool inBox = true;
+            for (int k = 0; k < 3 && inBox; k++) {
+                inBox = hit[k] >= f.min[k] - tol && hit[k] <= f.max[k] + tol;
+            }
+            if (!inBox) {
+                continue;
+            }
+            //a degenerate ray still counts all its hits, for the vote
+            bool nearEdge = false;
+            for (auto& loop : f.loops) {
+                for (int j = 0; j < loop.length() && !nearEdge; j++) {
+                    const AcGePoint3d& p0 = f.pts[loop[j]];
+                    const AcGePoint3d& p1 = f.pts[loop[j == loop.length() - 1 ? 0 : j + 1]];
+                    AcGeVector3d seg = p1 - p0;
+                    double t = seg.dotProduct(hit - p0) / std::max(seg.lengthSqrd(), tol * tol);
+                    t = std::min(1.0, std::max(0.0, t));
+                    nearEdge = (p0 + seg * t).distanceTo(hit) <= tol;
+                }
+            }
+            clean = clean && !nearEdge;
+            AcGeVector3d lineDir = f.normal.perpVector();
+            if (ptInLoop2(hit, lineDir, f)) {
+                count++;
+            }
+        }
+        if (clean) {
+            return count % 2 == 1;
+        }
+        votesIn += count % 2;
+    }
+    return 2 * votesIn > maxRays;
+}
+
+//faces of a that can reach the box of b. the box is padded by the weld
+//tolerance, a face touching b within it still has to be split
+bool surfaceReaches(body& a, body& b) {
+    const double tol = AcGeContext::gTol.equalPoint();
+    const AcGeVector3d inflate(tol, tol, tol);
+    const AcGePoint3d bMin = b.min - inflate, bMax = b.max + inflate;
+    if (!boxesOverlap(a.min, a.max, bMin, bMax)) {
+        return false;
+    }
+    for (int start = 0; start < a.faces.length(); start += 64) {
+        if (overlapMask(a.faces.asArrayPtr() + start, std::min(64, a.faces.length() - start), bMin, bMax)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//operands that need no face splitting. when the surface of one body stays
+//out of the box of the other, the other lies completely inside or
+//completely outside it and one point decides which, so the faces are put
+//into the result arrays as they are
+bool trivialClassify(booleanContext& ctx, body& a, body& b) {
+    bool aInB = false, bInA = false;
+    if (!surfaceReaches(a, b)) {
+        bInA = encounter(a, b) && ptInBody(b.faces[0]->pts[0], a);
+    }
+    else if (!surfaceReaches(b, a)) {
+        aInB = encounter(a, b) && ptInBody(a.faces[0]->pts[0], b);
+    }
+    else {
+        return false;
+    }
+    (aInB ? ctx.AinB : ctx.AoutB).append(a.faces);
+    (bInA ? ctx.BinA : ctx.BoutA).append(b.faces);
+    return true;
+}
+
+enum boolType {
+    Union,
+    Intersect,
+    Subtruct
+};
+
+//faces made of the same vertices are coincident. the sorted vertex list of
+//every face is kept in one flat buffer and hashed into an open addressing
+//table of face indices, a face that finds its list in the table marks
+//both faces
+void caculateFace(body2& bd) {
+    const int numFaces = bd.m.faceCount();
+    AcGeIntArray offsets, sorted;
+    offsets.setLogicalLength(numFaces + 1);
+    offsets[0] = 0;
+    for (int i = 0; i < numFaces; i++) {
+        int length;
+        bd.m.firstLoop(i, length);
+        offsets[i + 1] = offsets[i] + length;
+    }
+    sorted.setLogicalLength(offsets[numFaces]);
+    size_t size = 16;
+    while (size < size_t(numFaces) * 2) {
+        size <<= 1;
+    }
+    const size_t mask = size - 1;
+    std::vector<int> table(size, -1);
+    for (int i = 0; i < numFaces; i++) {
+        int length;
+        const int* loop = bd.m.firstLoop(i, length);
+        if (length == 0) {
+            continue;
+        }
+        int* tuple = sorted.asArrayPtr() + offsets[i];
+        std::copy(loop, loop + length, tuple);
+        std::sort(tuple, tuple + length);
+        unsigned long long hash = 14695981039346656037ULL;
+        for (int k = 0; k < length; k++) {
+            hash = (hash ^ (unsigned int)tuple[k]) * 1099511628211ULL;
+        }
+        size_t slot = size_t(hash ^ (hash >> 32)) & mask;
+        for (; table[slot] >= 0; slot = (slot + 1) & mask) {
+            int f = table[slot];
+            if (offsets[f + 1] - offsets[f] == length && std::equal(tuple, tuple + length, sorted.asArrayPtr() + offsets[f])) {
                 bd.coincides[i] = true;
                 bd.coincides[f] = true;
+                break;
+            }
+        }
+        if (table[slot] < 0) {
+            table[slot] = i;
+        }
+    }
+}
+
+//welds points that are equal within tolerance into welded, ids gets the
+//welded index of every point. points are hashed into the cells of
+//endpointMap and welded cell by cell, only points within tolerance of a
+//cell wall are compared with the neighbour cells afterwards. every group
+//of welded points takes the position of its first point and the groups
+//are numbered in order of first appearance, so the result is the same
+//for any thread count
+void weldVertices(const std::vector<AcGePoint3d*>& pts, std::vector<AcGePoint3d>& welded, AcGeIntArray& ids, int numThreads = 1) {
+    typedef endpointMap::cellKey cellKey;
+    const double tol = AcGeContext::gTol.equalPoint();
+    const double cellSize = tol * 1024;
+    const int n = int(pts.size());
+    std::vector<cellKey> keys(n);
+    parallelFor(n, 4096, numThreads, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            const AcGePoint3d& pt = *pts[i];
+            keys[i] = cellKey{ (long long)floor(pt.x / cellSize), (long long)floor(pt.y / cellSize), (long long)floor(pt.z / cellSize) };
+        }
+    });
+    //cells numbered in order of their first point in an open addressing
+    //table of first points, the points of a cell are kept ascending in
+    //cellPoints
+    endpointMap::cellHash hash;
+    size_t mask = 1;
+    while (mask < size_t(n) * 2) {
+        mask <<= 1;
+    }
+    mask -= 1;
+    std::vector<int> table(mask + 1, -1);
+    auto findCell = [&](const cellKey& key) {
+        size_t slot = hash(key) & mask;
+        while (table[slot] >= 0 && !(keys[table[slot]] == key)) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    };
+    std::vector<int> cellOf(n);
+    int numCells = 0;
+    for (int i = 0; i < n; i++) {
+        size_t slot = findCell(keys[i]);
+        if (table[slot] < 0) {
+            table[slot] = i;
+            cellOf[i] = numCells++;
+        }
+        else {
+            cellOf[i] = cellOf[table[slot]];
+        }
+    }
+    AcGeIntArray cellStart, cellPoints;
+    cellStart.setLogicalLength(numCells + 1);
+    cellStart.setAll(0);
+    for (int i = 0; i < n; i++) {
+        cellStart[cellOf[i] + 1]++;
+    }
+    for (int c = 0; c < numCells; c++) {
+        cellStart[c + 1] += cellStart[c];
+    }
+    AcGeIntArray fill = cellStart;
+    cellPoints.setLogicalLength(n);
+    for (int i = 0; i < n; i++) {
+        cellPoints[fill[cellOf[i]]++] = i;
+    }
+    //every point goes to the first earlier point of its cell that is equal
+    //to it and not welded itself
+    std::vector<int> root(n);
+    parallelFor(numCells, 1024, numThreads, [&](int begin, int end) {
+        for (int c = begin; c < end; c++) {
+            for (int k = cellStart[c]; k < cellStart[c + 1]; k++) {
+                int i = cellPoints[k];
+                root[i] = i;
+                for (int m = cellStart[c]; m < k; m++) {
+                    int j = cellPoints[m];
+                    if (root[j] == j && pts[j]->isEqualTo(*pts[i])) {
+                        root[i] = j;
+                        break;
+                    }
+                }
+            }
+        }
+    });
+    auto findRoot = [&](int i) {
+        while (root[i] != i) {
+            i = root[i] = root[root[i]];
+        }
+        return i;
+    };
+    //points near a wall join the equal points of the neighbour cells, the
+    //smaller index stays the root
+    for (int i = 0; i < n; i++) {
+        const AcGePoint3d& pt = *pts[i];
+        long long lo[3], hi[3];
+        for (int c = 0; c < 3; c++) {
+            double offset = pt[c] - floor(pt[c] / cellSize) * cellSize;
+            lo[c] = offset < tol ? -1 : 0;
+            hi[c] = cellSize - offset < tol ? 1 : 0;
+        }
+        for (long long dx = lo[0]; dx <= hi[0]; dx++) {
+            for (long long dy = lo[1]; dy <= hi[1]; dy++) {
+                for (long long dz = lo[2]; dz <= hi[2]; dz++) {
+                    if (dx == 0 && dy == 0 && dz == 0) {
+                        continue;
+                    }
+                    int first = table[findCell(cellKey{ keys[i].x + dx, keys[i].y + dy, keys[i].z + dz })];
+                    if (first < 0) {
+                        continue;
+                    }
+                    int c = cellOf[first];
+                    for (int k = cellStart[c]; k < cellStart[c + 1]; k++) {
+                        int j = cellPoints[k];
+                        if (!pts[j]->isEqualTo(pt)) {
+                            continue;
+                        }
+                        int ri = findRoot(i), rj = findRoot(j);
+                        if (ri < rj) {
+                            root[rj] = ri;
+                        }
+                        else if (rj < ri) {
+                            root[ri] = rj;
+                        }
+                    }
+                }
             }
         }
     }
+    welded.clear();
+    ids.setLogicalLength(n);
+    for (int i = 0; i < n; i++) {
+        int r = findRoot(i);
+        if (r == i) {
+            ids[i] = int(welded.size());
+            welded.push_back(*pts[i]);
+        }
+        else {
+            ids[i] = ids[r];
+        }
+    }
 }
 
-void hilbertSort(std::vector<int>& sortedIndex, const std::vector<AcGePoint3d*>& pts);
+void hilbertSort(std::vector<int>& sortedIndex, const std::vector<AcGePoint3d*>& pts, int numThreads = 1);
 
-void compressVertex2(body* bd, body2& ret) {
-    std::vector<AcGePoint3d>& pts2 = ret.pts;
+void compressVertex2(body* bd, body2& ret, int numThreads = 1) {
     std::vector<AcGePoint3d*> pts;
-    std::vector<int> sortedIndex;
-    int vtCount = 0;
     for (auto& f : bd->faces) {
         for (auto& pt : f->pts) {
             pts.push_back(&pt);
-            sortedIndex.push_back(vtCount++);
         }
     }
-    hilbertSort(sortedIndex, pts);
-    AcGePoint3dArray ptss;
-    for (int i = 0; i < pts.size(); i++) {
-        ptss.append(*pts[sortedIndex[i]]);
-    }
-    if (sortedIndex.size() <= 0) {
+    if (pts.empty()) {
         return;
     }
-    pts2.push_back(*pts[sortedIndex[0]]);
-    std::vector<int> sortedIndex2 = sortedIndex;
-    sortedIndex2[0] = 0;
-    for (int i = 1; i < sortedIndex.size(); i++) {
-        if (pts2.back().isEqualTo(*pts[sortedIndex[i]])) {
-            sortedIndex2[i] = sortedIndex2[i - 1];
-        }
-        else {
-            pts2.push_back(*pts[sortedIndex[i]]);
-            sortedIndex2[i] = sortedIndex2[i - 1] + 1;
-        }
+    AcGeIntArray ids;
+    std::vector<AcGePoint3d> welded;
+    weldVertices(pts, welded, ids, numThreads);
+    //welded points numbered along a hilbert curve, neighbours in space stay
+    //close in the coordinate buffer of ret
+    std::vector<AcGePoint3d*> weldedPts;
+    std::vector<int> order;
+    for (int i = 0; i < int(welded.size()); i++) {
+        weldedPts.push_back(&welded[i]);
+        order.push_back(i);
+    }
+    hilbertSort(order, weldedPts, numThreads);
+    AcGeIntArray rank;
+    rank.setLogicalLength(int(order.size()));
+    for (int i = 0; i < int(order.size()); i++) {
+        rank[order[i]] = i;
+        ret.m.addVertex(welded[order[i]]);
+    }
+    for (auto& id : ids) {
+        id = rank[id];
     }
-    AcGeIntArray invertSortedIndex;
-    invertSortedIndex.setLogicalLength(int(sortedIndex.size()));
-    for (int i = 0; i < sortedIndex.size(); i++) {
-        invertSortedIndex[sortedIndex[i]] = i;
-    }
-    vtCount = 0;
+    int vtCount = 0;
+    AcGeIntArray tempFace;
     for (auto& f : bd->faces) {
-        AcGeIntArray tempFace;
         tempFace.setLogicalLength(f->loops[0].length());
         for (int i = 0; i < f->loops[0].length(); i++) {
-            tempFace[i] = sortedIndex2[invertSortedIndex[f->loops[0][i] + vtCount]];
+            tempFace[i] = ids[f->loops[0][i] + vtCount];
         }
         vtCount += f->pts.length();
         ret.fStatus.append(f->status);
-        ret.faces.append(tempFace);
-    }
-    ret.coincides.setLogicalLength(ret.faces.length());
-    for (int i = 0; i < ret.coincides.length(); i++) {
-        ret.coincides[i] = false;
+        ret.m.addFace(f->normal);
+        ret.m.addLoop(tempFace.asArrayPtr(), tempFace.length());
     }
+    ret.coincides.setLogicalLength(ret.m.faceCount());
+    ret.coincides.setAll(false);
 }
 
 void putBigLoopFront(face& face) {
@@ -3944,14 +5772,12 @@ bool passLoops(loopBox& bridge, face& face) {
     p1.x = std::min(bridge.min.x, bridge.max.x);
     p1.y = std::min(bridge.min.y, bridge.max.y);
     p1.z = std::min(bridge.min.z, bridge.max.z);
+    unsigned long long mask = 0;
     for (int i = 1; i < face.loopBoxs.length() - 1; i++) {
-        if (p0.x < face.loopBoxs[i].min.x || p1.x > face.loopBoxs[i].max.x) {
-            continue;
-        }
-        if (p0.y < face.loopBoxs[i].min.y || p1.y > face.loopBoxs[i].max.y) {
-            continue;
+        if ((i - 1) % 64 == 0) {
+            mask = overlapMask(face.loopBoxs.asArrayPtr() + i, std::min(64, face.loopBoxs.length() - 1 - i), p1, p0);
         }
-        if (p0.z < face.loopBoxs[i].min.z || p1.z > face.loopBoxs[i].max.z) {
+        if (!(mask >> ((i - 1) % 64) & 1)) {
             continue;
         }
         face.loops.swap(i, face.loopBoxs.length() - 1);
@@ -4147,12 +5973,20 @@ void dealWithMultiLoops(face& face) {
     }
 }
 
-void bodyBodyBool(body& a, body& b, boolType type, body2& ret) {
-    for (auto& f : a.faces) {
-        faceBodyIntersect(*f, b, AinB, AoutB);
-    }
-    for (auto& f : b.faces) {
-        faceBodyIntersect(*f, a, BinA, BoutA);
+void BodyTobody(Body* bd, body& body, booleanArena& arena);
+void bodyBodyBool(booleanContext& ctx, Body* ab, Body* bb, boolType type, mesh& ret) {
+    body a, b;
+    BodyTobody(ab, a, ctx.arena);
+    BodyTobody(bb, b, ctx.arena);
+    int numThreads = ctx.numThreads > 0 ? ctx.numThreads : std::max(1, int(std::thread::hardware_concurrency()));
+    if (a.faces.isEmpty() || b.faces.isEmpty() || !trivialClassify(ctx, a, b)) {
+        faceBVH bvhA, bvhB;
+        bvhA.build(a);
+        bvhB.build(b);
+        sectionLines lines(a.faces.length());
+        classifyFaces(a, b, bvhB, lines, ctx.AinB, ctx.AoutB, ctx.chainHook, ctx.arena, numThreads);
+        lines.flip(b.faces.length());
+        classifyFaces(b, a, bvhA, lines, ctx.BinA, ctx.BoutA, ctx.chainHook, ctx.arena, numThreads);
     }
     body temp;
     auto addFaceToTemp = [&](AcArray<face*>& faces, faceStatus status) {
@@ -4161,55 +5995,78 @@ void bodyBodyBool(body& a, body& b, boolType type, body2& ret) {
             temp.faces.append(f);
         }
         };
-    addFaceToTemp(AinB, ainb);
-    addFaceToTemp(AoutB, aoutb);
-    addFaceToTemp(BinA, bina);
-    addFaceToTemp(BoutA, bouta);
+    addFaceToTemp(ctx.AinB, ainb);
+    addFaceToTemp(ctx.AoutB, aoutb);
+    addFaceToTemp(ctx.BinA, bina);
+    addFaceToTemp(ctx.BoutA, bouta);
     for (auto& f : temp.faces) {
         if (f->loops.length() > 1) {
             dealWithMultiLoops(*f);
         }
     }
-    compressVertex2(&temp, ret);
-    caculateFace(ret);
-    AcArray<AcGeIntArray> faces(ret.faces.length());
-    switch (type) {
-    case Union:
-        for (int i = 0; i < ret.faces.length(); i++) {
-            if (ret.fStatus[i] == aoutb || ret.fStatus[i] == bouta || (ret.fStatus[i] == ainb && ret.coincides[i])) {
-                faces.append(ret.faces[i]);
-            }
+    body2 classified;
+    compressVertex2(&temp, classified, numThreads);
+    caculateFace(classified);
+    ret.x = std::move(classified.m.x);
+    ret.y = std::move(classified.m.y);
+    ret.z = std::move(classified.m.z);
+    AcGeIntArray reversed;
+    for (int i = 0; i < classified.m.faceCount(); i++) {
+        faceStatus status = classified.fStatus[i];
+        bool coincide = classified.coincides[i];
+        bool keep = false, reverse = false;
+        switch (type) {
+        case Union:
+            keep = status == aoutb || status == bouta || (status == ainb && coincide);
+            break;
+        case Intersect:
+            keep = status == ainb || (status == bina && !coincide);
+            break;
+        case Subtruct:
+            keep = status == aoutb || (status == bina && !coincide);
+            reverse = status == bina;
+            break;
+        default:
+            break;
         }
-        break;
-    case Intersect:
-        for (int i = 0; i < ret.faces.length(); i++) {
-            if (ret.fStatus[i] == ainb || (ret.fStatus[i] == bina && !ret.coincides[i])) {
-                faces.append(ret.faces[i]);
-            }
+        if (!keep) {
+            continue;
         }
-        break;
-    case Subtruct:
-        for (int i = 0; i < ret.faces.length(); i++) {
-            if (ret.fStatus[i] == aoutb) {
-                faces.append(ret.faces[i]);
-            }
-            if (ret.fStatus[i] == bina && !ret.coincides[i]){
-                faces.append(ret.faces[i]);
-                for (int j = 0; j < ret.faces[i].length() / 2; j++) {
-                    std::swap(faces.last()[j], faces.last()[ret.faces[i].length() - 1 - j]);
-                }
-            }
+        int length;
+        const int* loop = classified.m.firstLoop(i, length);
+        if (reverse) {
+            reversed.setLogicalLength(length);
+            std::reverse_copy(loop, loop + length, reversed.begin());
+            ret.addFace(-classified.m.normals[i]);
+            ret.addLoop(reversed.asArrayPtr(), length);
+        }
+        else {
+            ret.addFace(classified.m.normals[i]);
+            ret.addLoop(loop, length);
         }
-        break;
-    default:
-        break;
     }
-    ret.faces = faces;
+}
+
+//custom boolean of a and b into ret. every call works on its own
+//booleanContext, hook receives the section chains that could not be closed.
+//numThreads is the number of worker threads, 0 for all cores. arenaBytes
+//receives the high-water mark of the arena holding the temporary faces,
+//their heap array buffers included
+void booleanOperation(Body* a, Body* b, boolType type, mesh& ret, openChainHook hook = nullptr, int numThreads = 0, size_t* arenaBytes = nullptr) {
+    booleanContext ctx;
+    ctx.chainHook = hook;
+    ctx.numThreads = numThreads;
+    bodyBodyBool(ctx, a, b, type, ret);
+    if (arenaBytes) {
+        *arenaBytes = ctx.arena.highWaterMark();
+    }
 }
 void test202561(Body* body, std::string filePath);
-void BodyTobody(Body* bd, body& body) {
+//faces of the boolean engine from an AModeler body, every face gets its own
+//copy of its points with the biggest loop in front
+void BodyTobody(Body* bd, body& body, booleanArena& arena) {
     for (Face* f = bd->faceList(); f != NULL; f = f->next()) {
-        face* tempFace = new face();
+        face* tempFace = arena.make<face>();
         tempFace->normal = (f->plane().normal);
         Edge* curEdge = f->edgeLoop();
         std::vector<int> loop;
@@ -4266,6 +6123,7 @@ void BodyTobody(Body* bd, body& body) {
         }
         tempFace->caculateBox();
         putBigLoopFront(*tempFace);
+        tempFace->caculatePlane();
         body.faces.append(tempFace);
     }
 #if test123
@@ -4304,230 +6162,305 @@ void BodyTobody(Body* bd, body& body) {
     body.caculateBox();
 }
 
-struct cmp {
-    const std::vector<AcGePoint3d*>& pts;
-    int coord;
-    bool up;
-    bool operator() (int i1, int i2) {
-        //if (coord == 0) {
-        //    return (pts[i1]->x < pts[i2]->x) == up;
-        //}
-        //else if (coord == 1) {
-        //    return (pts[i1]->y < pts[i2]->y) == up;
-        //}
-        //else {
-        //    return (pts[i1]->z < pts[i2]->z) == up;
-        //}
-        if (pts[i1]->x < pts[i2]->x - 1e-10) {
-            return true;
-        }
-        if (pts[i1]->x > pts[i2]->x + 1e-10) {
-            return false;
-        }
-        if (pts[i1]->y < pts[i2]->y - 1e-10) {
-            return true;
-        }
-        if (pts[i1]->y > pts[i2]->y + 1e-10) {
-            return false;
-        }
-        if (pts[i1]->z < pts[i2]->z - 1e-10) {
-            return true;
-        }
-        if (pts[i1]->z > pts[i2]->z + 1e-10) {
-            return false;
+//3d hilbert curve after Skilling, one level at a time. below every level
+//the transform permutes and reflects the axes, so the state is one of the
+//48 such transforms (perm * 8 + flip) and a table maps state and octant to
+//the octant bits seen through the transform and to the next state
+struct hilbertTable {
+    unsigned char octant[48][8];
+    unsigned char next[48][8];
+    hilbertTable() {
+        static const int perms[6][3] = { {0, 1, 2}, {0, 2, 1}, {1, 0, 2}, {1, 2, 0}, {2, 0, 1}, {2, 1, 0} };
+        auto permIndex = [&](const int* perm) {
+            for (int k = 0; k < 6; k++) {
+                if (perms[k][0] == perm[0] && perms[k][1] == perm[1]) {
+                    return k;
+                }
+            }
+            return 0;
+        };
+        for (int s = 0; s < 48; s++) {
+            const int* perm = perms[s / 8];
+            int flip = s % 8;
+            for (int o = 0; o < 8; o++) {
+                int v = 0;
+                for (int i = 0; i < 3; i++) {
+                    v |= (((o >> perm[i]) ^ (flip >> i)) & 1) << i;
+                }
+                octant[s][o] = (unsigned char)v;
+                //the bits below this level: x[0] is reflected when bit i
+                //is set, else x[0] and x[i] are exchanged
+                int curPerm[3] = { perm[0], perm[1], perm[2] };
+                int curFlip[3] = { flip & 1, (flip >> 1) & 1, (flip >> 2) & 1 };
+                for (int i = 0; i < 3; i++) {
+                    if ((v >> i) & 1) {
+                        curFlip[0] ^= 1;
+                    }
+                    else {
+                        std::swap(curPerm[0], curPerm[i]);
+                        std::swap(curFlip[0], curFlip[i]);
+                    }
+                }
+                next[s][o] = (unsigned char)(permIndex(curPerm) * 8 + (curFlip[0] | curFlip[1] << 1 | curFlip[2] << 2));
+            }
         }
-        return true;
     }
 };
 
-std::vector<int>::iterator reorder_split(std::vector<int>::iterator b, std::vector<int>::iterator e, cmp cmp) {
-    if (b >= e) return b;
-    std::vector<int>::iterator m = b + (e - b) / 2;
-    std::nth_element(b, m, e, cmp);
-    return m;
+//hilbert index of a point quantized to 21 bits per axis
+unsigned long long hilbertKey(const unsigned int x[3]) {
+    static const hilbertTable table;
+    unsigned long long key = 0;
+    int state = 0;
+    int parity = 0;
+    for (int b = 20; b >= 0; b--) {
+        int o = ((x[0] >> b) & 1) | ((x[1] >> b) & 1) << 1 | ((x[2] >> b) & 1) << 2;
+        int v = table.octant[state][o];
+        state = table.next[state][o];
+        //gray code, every set bit of the last axis reflects the levels below
+        int g0 = v & 1;
+        int g1 = ((v >> 1) & 1) ^ g0;
+        int g2 = ((v >> 2) & 1) ^ g1;
+        int digit = (g0 << 2 | g1 << 1 | g2) ^ (parity ? 7 : 0);
+        parity ^= g2;
+        key = key << 3 | digit;
+    }
+    return key;
 }
 
-void sort(const std::vector<AcGePoint3d*>& pts, std::vector<int>::iterator b, std::vector<int>::iterator e, int coordx, bool upx, bool upy, bool upz) {
-    const int coordy = (coordx + 1) % 3;
-    const int coordz = (coordx + 2) % 3;
-    if (e - b <= 1) {
+//orders sortedIndex along a hilbert curve through the box of the points.
+//the keys are sorted with a stable lsd radix sort, 8 bits per pass, every
+//chunk counts and scatters its own part so equal keys keep their order
+//for any thread count
+void hilbertSort(std::vector<int>& sortedIndex, const std::vector<AcGePoint3d*>& pts, int numThreads) {
+    const int n = int(sortedIndex.size());
+    if (n <= 1) {
         return;
     }
-    std::vector<int>::iterator m0 = b;
-    std::vector<int>::iterator m8 = e;
-    std::vector<int>::iterator m4 = reorder_split(m0, m8, cmp{pts, coordx, upx});
-    std::vector<int>::iterator m2 = reorder_split(m0, m4, cmp{pts, coordy, upy});
-    std::vector<int>::iterator m1 = reorder_split(m0, m2, cmp{pts, coordz, upz});
-    std::vector<int>::iterator m3 = reorder_split(m2, m4, cmp{pts, coordz, !upz});
-    std::vector<int>::iterator m6 = reorder_split(m4, m8, cmp{pts, coordy, !upy});
-    std::vector<int>::iterator m5 = reorder_split(m4, m6, cmp{pts, coordz, upz});
-    std::vector<int>::iterator m7 = reorder_split(m6, m8, cmp{pts, coordz, !upz});
-    sort(pts, m0, m1, coordz, upz, upx, upy);
-    sort(pts, m1, m2, coordy, upy, upz, upx);
-    sort(pts, m2, m3, coordy, upy, upz, upx);
-    sort(pts, m3, m4, coordx, upx, !upy, !upz);
-    sort(pts, m4, m5, coordx, upx, !upy, !upz);
-    sort(pts, m5, m6, coordy, !upy, upz, !upx);
-    sort(pts, m6, m7, coordy, !upy, upz, !upx);
-    sort(pts, m7, m8, coordz, !upz, !upx, upy);
-
-}
-
-void hilbertSortRecursive(std::vector<int>& sortedIndex, const std::vector<AcGePoint3d*>& pts, std::vector<int>::iterator b, std::vector<int>::iterator e) {
-    std::vector<int>::iterator m = b;
-    //if ((e - b) > 64) {
-    //    m = b + int(0.125 * (e - b));
-    //    hilbertSortRecursive(sortedIndex, pts, b, m);
-    //}
-    sort(pts, m, e, 0, false, false, false);
-}
-
-void hilbertSort(std::vector<int>& sortedIndex, const std::vector<AcGePoint3d*>& pts) {
-    std::vector<int>::iterator b = sortedIndex.begin();
-    std::vector<int>::iterator e = sortedIndex.end();
-    hilbertSortRecursive(sortedIndex, pts, b, e);
+    AcGePoint3d min = *pts[sortedIndex[0]], max = min;
+    for (int i : sortedIndex) {
+        for (int c = 0; c < 3; c++) {
+            min[c] = std::min(min[c], (*pts[i])[c]);
+            max[c] = std::max(max[c], (*pts[i])[c]);
+        }
+    }
+    double extent = std::max(max.x - min.x, std::max(max.y - min.y, max.z - min.z));
+    double scale = extent > 0 ? ((1 << 21) - 1) / extent : 0;
+    std::vector<unsigned long long> keys(n), keys2(n);
+    std::vector<int> index2(n);
+    parallelFor(n, 4096, numThreads, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            unsigned int x[3];
+            for (int c = 0; c < 3; c++) {
+                x[c] = (unsigned int)(((*pts[sortedIndex[i]])[c] - min[c]) * scale);
+            }
+            keys[i] = hilbertKey(x);
+        }
+    });
+    const int chunkSize = std::max(4096, (n + numThreads - 1) / numThreads);
+    const int numChunks = (n + chunkSize - 1) / chunkSize;
+    const int radix = 1 << 8;
+    std::vector<int> counts(numChunks * radix);
+    for (int shift = 0; shift < 63; shift += 8) {
+        std::fill(counts.begin(), counts.end(), 0);
+        parallelFor(n, chunkSize, numThreads, [&](int begin, int end) {
+            int* count = &counts[(begin / chunkSize) * radix];
+            for (int i = begin; i < end; i++) {
+                count[(keys[i] >> shift) & (radix - 1)]++;
+            }
+        });
+        //all keys share this digit
+        bool same = false;
+        for (int d = 0; d < radix && !same; d++) {
+            int total = 0;
+            for (int c = 0; c < numChunks; c++) {
+                total += counts[c * radix + d];
+            }
+            same = total == n;
+        }
+        if (same) {
+            continue;
+        }
+        int offset = 0;
+        for (int d = 0; d < radix; d++) {
+            for (int c = 0; c < numChunks; c++) {
+                int count = counts[c * radix + d];
+                counts[c * radix + d] = offset;
+                offset += count;
+            }
+        }
+        parallelFor(n, chunkSize, numThreads, [&](int begin, int end) {
+            int* next = &counts[(begin / chunkSize) * radix];
+            for (int i = begin; i < end; i++) {
+                int pos = next[(keys[i] >> shift) & (radix - 1)]++;
+                keys2[pos] = keys[i];
+                index2[pos] = sortedIndex[i];
+            }
+        });
+        keys.swap(keys2);
+        sortedIndex.swap(index2);
+    }
 }
 
 void compressVertex(body* bd, std::vector<AcGePoint3d>& pts2, std::vector<std::vector<int>>& fs) {
     std::vector<AcGePoint3d*> pts;
-    std::vector<int> sortedIndex;
-    int vtCount = 0;
     for (auto& f : bd->faces) {
         for (auto& pt : f->pts) {
             pts.push_back(&pt);
-            sortedIndex.push_back(vtCount++);
-        }
-    }
-    hilbertSort(sortedIndex, pts);
-    //std::sort(sortedIndex.begin(), sortedIndex.end(), [&](int i1 ,int i2)
-    //    {
-    //        if (pts[i1]->x < pts[i2]->x - 1e-10) {
-    //            return true;
-    //        }
-    //        if (pts[i1]->x > pts[i2]->x + 1e-10) {
-    //            return false;
-    //        }
-    //        if (pts[i1]->y < pts[i2]->y - 1e-10) {
-    //            return true;
-    //        }
-    //        if (pts[i1]->y > pts[i2]->y + 1e-10) {
-    //            return false;
-    //        }
-    //        if (pts[i1]->z < pts[i2]->z - 1e-10) {
-    //            return true;
-    //        }
-    //        if (pts[i1]->z > pts[i2]->z + 1e-10) {
-    //            return false;
-    //        }
-    //        return true;
-    //    });
-    AcGePoint3dArray ptss;
-    for (int i = 0; i < pts.size(); i++) {
-        ptss.append(*pts[sortedIndex[i]]);
-    }
-    pts2.push_back(*pts[sortedIndex[0]]);
-    std::vector<int> sortedIndex2 = sortedIndex;
-    sortedIndex2[0] = 0;
-    for (int i = 1; i < sortedIndex.size(); i++) {
-        if (pts2.back().isEqualTo(*pts[sortedIndex[i]])) {
-            sortedIndex2[i] = sortedIndex2[i - 1];
         }
-        else {
-            pts2.push_back(*pts[sortedIndex[i]]);
-            sortedIndex2[i] = sortedIndex2[i - 1] + 1;
-        }
-    }
-    AcGeIntArray invertSortedIndex;
-    invertSortedIndex.setLogicalLength(int(sortedIndex.size()));
-    for (int i = 0; i < sortedIndex.size(); i++) {
-        invertSortedIndex[sortedIndex[i]] = i;
     }
-    vtCount = 0;
+    AcGeIntArray ids;
+    weldVertices(pts, pts2, ids);
+    int vtCount = 0;
     for (auto& f : bd->faces) {
         std::vector<int> tempFace;
         tempFace.resize(f->loops[0].length());
         for (int i = 0; i < f->loops[0].length(); i++) {
-            tempFace[i] = sortedIndex2[invertSortedIndex[f->loops[0][i] + vtCount]];
+            tempFace[i] = ids[f->loops[0][i] + vtCount];
         }
         vtCount += f->pts.length();
         fs.push_back(tempFace);
     }
 }
 
-struct noDirEdge
-{
-    int v1;
-    int v2;
-    noDirEdge(int v1, int v2) {
-        this->v1 = v1;
-        this->v2 = v2;
-    }
-    bool operator<(const noDirEdge& other) const {
-        if (v1 + v2 < other.v1 + other.v2)
-        {
-            return true;
+//partner edges of a polygon mesh. half edges are grouped by the ordered
+//vertex pair of their ends in an open addressing table sized up front,
+//link() then sets the partners group by group
+struct edgeTwinBuilder {
+    struct halfEdge {
+        Edge* edge;
+        int from;
+        int nextInGroup;
+    };
+    AcArray<halfEdge> halfEdges;
+    std::vector<unsigned long long> keys;
+    std::vector<int> heads;//first half edge of the group in the slot, -1 for an empty slot
+    std::vector<int> tails;
+    size_t mask;
+
+    edgeTwinBuilder(int numHalfEdges) {
+        halfEdges.setPhysicalLength(numHalfEdges);
+        size_t size = 16;
+        while (size < size_t(numHalfEdges)) {
+            size <<= 1;
+        }
+        mask = size - 1;
+        keys.resize(size);
+        heads.assign(size, -1);
+        tails.resize(size);
+    }
+    void add(int from, int to, Edge* edge) {
+        unsigned long long key = (unsigned long long)(unsigned int)std::min(from, to) << 32 | (unsigned int)std::max(from, to);
+        size_t slot = size_t((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+        while (heads[slot] >= 0 && keys[slot] != key) {
+            slot = (slot + 1) & mask;
+        }
+        int index = halfEdges.append(halfEdge{ edge, from, -1 });
+        if (heads[slot] < 0) {
+            keys[slot] = key;
+            heads[slot] = index;
         }
-        if (v1 + v2 > other.v1 + other.v2)
-        {
-            return false;
+        else {
+            halfEdges[tails[slot]].nextInGroup = index;
+        }
+        tails[slot] = index;
+    }
+    void link() {
+        for (size_t slot = 0; slot <= mask; slot++) {
+            if (heads[slot] < 0) {
+                continue;
+            }
+            //half edges of the group split by direction
+            halfEdge* forward[4];
+            halfEdge* backward[4];
+            int numForward = 0, numBackward = 0, count = 0;
+            int from = halfEdges[heads[slot]].from;
+            for (int i = heads[slot]; i >= 0; i = halfEdges[i].nextInGroup, count++) {
+                if (count >= 4) {
+                    continue;
+                }
+                if (halfEdges[i].from == from) {
+                    forward[numForward++] = &halfEdges[i];
+                }
+                else {
+                    backward[numBackward++] = &halfEdges[i];
+                }
+            }
+            switch (count) {
+            case 2:
+                //a manifold edge
+                if (numBackward == 1) {
+                    forward[0]->edge->setPartner(backward[0]->edge);
+                    backward[0]->edge->setPartner(forward[0]->edge);
+                }
+                break;
+            case 3:
+                //one face doubled on the edge, the lone edge takes the first
+                //opposite one and the other stays open
+                if (numBackward > 0) {
+                    forward[0]->edge->setPartner(backward[0]->edge);
+                    backward[0]->edge->setPartner(forward[0]->edge);
+                }
+                break;
+            case 4:
+                //two bodies touching along the edge, the partners go round
+                //the four edges alternating in direction
+                if (numForward == 2) {
+                    forward[0]->edge->setPartner(backward[0]->edge);
+                    backward[0]->edge->setPartner(forward[1]->edge);
+                    forward[1]->edge->setPartner(backward[1]->edge);
+                    backward[1]->edge->setPartner(forward[0]->edge);
+                }
+                break;
+            default:
+                break;
+            }
         }
-        return std::min(v1, v2) < std::min(other.v1, other.v2);
     }
-
 };
 
-#include <map>
-void bodyToBody(body2* bd, Body& body) {
+//mesh to AModeler body, only the first loop of every face is used
+void bodyToBody(const mesh& m, Body& body) {
 #ifndef RELEASE
     AcArray<AcGePoint3dArray> ptss;
-    for (auto& f : bd->faces) {
+    for (int i = 0; i < m.faceCount(); i++) {
+        int length;
+        const int* f = m.firstLoop(i, length);
         AcGePoint3dArray pts;
-        for (auto i : f) {
-            pts.append(bd->pts[i]);
+        for (int j = 0; j < length; j++) {
+            pts.append(m.point(f[j]));
         }
         ptss.append(pts);
     }
 #endif // !RELEASE
     std::vector<Vertex*> bodyVertex;
-    for (auto& p : bd->pts)
+    for (int i = 0; i < m.vertexCount(); i++)
     {
-        const Point3d ptem(p.x, p.y, p.z);
+        const Point3d ptem(m.x[i], m.y[i], m.z[i]);
         Vertex* vertex = new Vertex(ptem, &body);
         bodyVertex.push_back(vertex);
     }
 
-    std::map<noDirEdge, std::vector<Edge*>> edgeMap;
-    for (auto& f : bd->faces) {
+    edgeTwinBuilder twins(m.loopVertices.length());
+    for (int fi = 0; fi < m.faceCount(); fi++) {
+        int length;
+        const int* f = m.firstLoop(fi, length);
         int start = f[0];
         Face* face = new Face(&body);
         Edge* firstEdge = nullptr;
         Edge* prevEdge = nullptr;
-        for (int i = 0; i < f.length(); i++) {
+        for (int i = 0; i < length; i++) {
             int startIndex = f[i];
             int endIndex;
-            if (i == f.length() - 1) {
+            if (i == length - 1) {
                 endIndex = start;
             }
             else {
                 endIndex = f[i + 1];
             }
             Vertex* startVertex = bodyVertex[startIndex];
-            Vertex* endVertex = bodyVertex[endIndex];
-            noDirEdge parterKey = noDirEdge(startIndex, endIndex);
-            auto it = edgeMap.find(parterKey);
-
             Edge* edge = new Edge(startVertex, face, prevEdge, NULL);
-            if (it != edgeMap.end())
-            {
-
-                it->second.push_back(edge);
-            }
-            else
-            {
-                std::vector<Edge*> edges;
-                edges.push_back(edge);
-                edgeMap[parterKey] = edges;
-            }
+            twins.add(startIndex, endIndex, edge);
             if (!firstEdge) {
                 firstEdge = edge;
             }
@@ -4540,44 +6473,7 @@ void bodyToBody(body2* bd, Body& body) {
         firstEdge->setPrev(prevEdge);
         face->setEdgeLoop(firstEdge);
     }
-    for (auto it : edgeMap)
-    {
-        std::vector<Edge*> t = it.second;
-        if (t.size() == 2)
-        {
-            if (t[0]->vertex() == t[1]->vertex()) {
-                continue;
-            }
-            t[0]->setPartner(t[1]);
-            t[1]->setPartner(t[0]);
-        }
-        if (t.size() == 4)
-        {
-            std::vector<Edge*> t0;
-            std::vector<Edge*> t1;
-            t0.push_back(t[0]);
-            for (int i = 1; i < 4; i++) {
-                if (t[i]->vertex() == t[0]->vertex()) {
-                    t0.push_back(t[i]);
-                }
-                else {
-                    t1.push_back(t[i]);
-                }
-            }
-            if (t0.size() != t1.size()) {
-                continue;
-            }
-            t0[0]->setPartner(t1[0]);
-            t1[0]->setPartner(t0[1]);
-            t0[1]->setPartner(t1[1]);
-            t1[1]->setPartner(t0[0]);
-
-        }
-        if (t.size() == 3)
-        {
-            int ttt = 234;
-        }
-    }
+    twins.link();
 }
 void test202561(Body* body, std::string filePath);
 Body* test202541(std::string filePath);
@@ -4597,25 +6493,26 @@ void test202513() {
     if (!ent1 || !ent2) {
         return;
     }
-    body a, b;
-    BodyTobody(&(ent1->body()), a);
-    BodyTobody(&(ent2->body()), b);
+#ifdef test123
+    body a1;
+    booleanArena arena;
+    BodyTobody(&(ent1->body()), a1, arena);
     ent1->close();
     ent2->close();
-#ifdef test123
     body2 a2;
-    bodyTobody2(a2, a);
+    bodyTobody2(a2, a1);
     AsdkBody* ent11 = new AsdkBody();
-    bodyToBody(&a2, ent11->body());
+    bodyToBody(a2.m, ent11->body());
     AcDbObjectId id01;
     addToModelSpace(id01, ent11);
     return;
 #endif
-    AinB.setLogicalLength(0); AoutB.setLogicalLength(0); BinA.setLogicalLength(0); BoutA.setLogicalLength(0);
-    body2 ret;
-    bodyBodyBool(a, b, Subtruct, ret);
+    mesh ret;
+    booleanOperation(&(ent1->body()), &(ent2->body()), Subtruct, ret);
+    ent1->close();
+    ent2->close();
     AsdkBody* ent = new AsdkBody();
-    bodyToBody(&ret, ent->body());
+    bodyToBody(ret, ent->body());
     {
         std::string path1("C:\\½ļ\\inputs\\inputs\\spod.obj");
         test202561(&ent->body(), path1);
@@ -4624,6 +6521,126 @@ void test202513() {
     addToModelSpace(id0, ent);
 }
 
+//signed volume of a closed result mesh, the fans of the first loops
+static double meshVolume(const mesh& m) {
+    double volume = 0.0;
+    for (int i = 0; i < m.faceCount(); i++) {
+        int length;
+        const int* loop = m.firstLoop(i, length);
+        const AcGeVector3d p0 = m.point(loop[0]).asVector();
+        for (int j = 1; j + 1 < length; j++) {
+            volume += p0.dotProduct(m.point(loop[j]).asVector().crossProduct(m.point(loop[j + 1]).asVector()));
+        }
+    }
+    return volume / 6.0;
+}
+
+static double bodyVolume(Body& bd) {
+    double volume = 0.0;
+    for (Face* f = bd.faceList(); f != NULL; f = f->next()) {
+        Edge* first = f->edgeLoop();
+        const AcGeVector3d p0 = first->vertex()->point().asVector();
+        for (Edge* e = first->next(); e->next() != first; e = e->next()) {
+            volume += p0.dotProduct(e->vertex()->point().asVector().crossProduct(e->next()->vertex()->point().asVector()));
+        }
+    }
+    return volume / 6.0;
+}
+
+//the vector area of a closed surface is zero, it is compared with the
+//total area so that the test does not depend on the size
+static bool closedSurface(const AcGeVector3d& vectorArea, double area) {
+    return vectorArea.length() <= 1e-9 * area;
+}
+
+static bool meshClosed(const mesh& m) {
+    AcGeVector3d vectorArea(0, 0, 0);
+    double area = 0.0;
+    for (int i = 0; i < m.faceCount(); i++) {
+        int length;
+        const int* loop = m.firstLoop(i, length);
+        const AcGePoint3d p0 = m.point(loop[0]);
+        for (int j = 1; j + 1 < length; j++) {
+            AcGeVector3d cross = (m.point(loop[j]) - p0).crossProduct(m.point(loop[j + 1]) - p0);
+            vectorArea += cross;
+            area += cross.length();
+        }
+    }
+    return closedSurface(vectorArea, area);
+}
+
+static bool bodyClosed(Body& bd) {
+    AcGeVector3d vectorArea(0, 0, 0);
+    double area = 0.0;
+    for (Face* f = bd.faceList(); f != NULL; f = f->next()) {
+        Edge* first = f->edgeLoop();
+        const AcGePoint3d p0 = first->vertex()->point();
+        for (Edge* e = first->next(); e->next() != first; e = e->next()) {
+            AcGeVector3d cross = (e->vertex()->point() - p0).crossProduct(e->next()->vertex()->point() - p0);
+            vectorArea += cross;
+            area += cross.length();
+        }
+    }
+    return closedSurface(vectorArea, area);
+}
+
+static int bodyFaceCount(Body& bd) {
+    int count = 0;
+    for (Face* f = bd.faceList(); f != NULL; f = f->next()) {
+        count++;
+    }
+    return count;
+}
+
+//contacts within the weld tolerance: a face on a face, a vertex on a face
+//and a vertex through a face. every boolean is checked against the AModeler
+//boolean of the same operands: the volume, the face count and that the
+//result is closed
+void testBoolean() {
+    const double eps = 1e-12;
+    const boolType types[] = { Union, Intersect, Subtruct };
+    const AModeler::BoolOperType kinds[] = { AModeler::kBoolOperUnite, AModeler::kBoolOperIntersect, AModeler::kBoolOperSubtract };
+    const ACHAR* names[] = { ACRX_T("union"), ACRX_T("intersect"), ACRX_T("subtract") };
+    int bad = 0;
+    for (int c = 0; c < 3; c++) {
+        AsdkBody a, b;
+        a.createBox(AcGePoint3d(0, 0, 0), AcGeVector3d(2, 2, 2));
+        switch (c) {
+        case 0:
+            b.createBox(AcGePoint3d(2 + eps, 0, 0), AcGeVector3d(2, 2, 2));
+            break;
+        case 1:
+            b.createTetrahedron(AcGePoint3d(0.5, 0.5, 3), AcGePoint3d(1.5, 0.5, 3), AcGePoint3d(1, 1.5, 3), AcGePoint3d(1, 1, 2 + eps));
+            break;
+        default:
+            b.createTetrahedron(AcGePoint3d(0.5, 0.5, 3), AcGePoint3d(1.5, 0.5, 3), AcGePoint3d(1, 1.5, 3), AcGePoint3d(1, 1, 1));
+            break;
+        }
+        for (int t = 0; t < 3; t++) {
+            mesh ret;
+            booleanOperation(&a.body(), &b.body(), types[t], ret);
+            Body thisBody = a.body().copy();
+            Body thatBody = b.body().copy();
+            Body expected = thisBody.boolOper(thatBody, kinds[t]);
+            const double volume = meshVolume(ret);
+            const double expectedVolume = bodyVolume(expected);
+            const int faces = ret.faceCount();
+            const int expectedFaces = bodyFaceCount(expected);
+            const bool closed = meshClosed(ret);
+            const bool expectedClosed = bodyClosed(expected);
+            const bool same = fabs(volume - expectedVolume) < 1e-6 && faces == expectedFaces && closed == expectedClosed;
+            if (!same) {
+                bad++;
+            }
+            ads_printf(ACRX_T("\ncase %d %s: volume %.9f faces %d %s, AModeler %.9f faces %d %s%s"), c, names[t],
+                volume, faces, closed ? ACRX_T("closed") : ACRX_T("open"),
+                expectedVolume, expectedFaces, expectedClosed ? ACRX_T("closed") : ACRX_T("open"),
+                same ? ACRX_T("") : ACRX_T(" MISMATCH"));
+        }
+    }
+    ads_printf(ACRX_T("\n%d mismatches\n"), bad);
+}
+
 void test202561(Body* body, std::string filePath)
 {
     AcGePoint3dArray pts;
@@ -4710,7 +6727,7 @@ Body* test202541(std::string filePath)
         bodyVertex.push_back(vertex);
     }
 
-    std::map<noDirEdge, std::vector<Edge*>> edgeMap;
+    edgeTwinBuilder twins(fs.length());
 
     for (int i = 0; i < fs.length(); i++)
     {
@@ -4734,21 +6751,8 @@ Body* test202541(std::string filePath)
                 }
                 Vertex* startVertex = bodyVertex[startIndex];
                 Vertex* endVertex = bodyVertex[endIndex];
-                noDirEdge parterKey = noDirEdge(startIndex, endIndex);
-                auto it = edgeMap.find(parterKey);
-
                 Edge* edge = new Edge(startVertex, face, prevEdge, NULL);
-                if (it != edgeMap.end())
-                {
-
-                    it->second.push_back(edge);
-                }
-                else
-                {
-                    std::vector<Edge*> edges;
-                    edges.push_back(edge);
-                    edgeMap[parterKey] = edges;
-                }
+                twins.add(startIndex, endIndex, edge);
                 if (!firstEdge) {
                     firstEdge = edge;
                 }
@@ -4763,43 +6767,6 @@ Body* test202541(std::string filePath)
             face->setEdgeLoop(firstEdge);
         }
     }
-    for (auto it : edgeMap)
-    {
-        std::vector<Edge*> t = it.second;
-        if (t.size() == 2)
-        {
-            if (t[0]->vertex() == t[1]->vertex()) {
-                continue;
-            }
-            t[0]->setPartner(t[1]);
-            t[1]->setPartner(t[0]);
-        }
-        if (t.size() == 4)
-        {
-            std::vector<Edge*> t0;
-            std::vector<Edge*> t1;
-            t0.push_back(t[0]);
-            for (int i = 1; i < 4; i++) {
-                if (t[i]->vertex() == t[0]->vertex()) {
-                    t0.push_back(t[i]);
-                }
-                else {
-                    t1.push_back(t[i]);
-                }
-            }
-            if (t0.size() != t1.size()) {
-                continue;
-            }
-            t0[0]->setPartner(t1[0]);
-            t1[0]->setPartner(t0[1]);
-            t0[1]->setPartner(t1[1]);
-            t1[1]->setPartner(t0[0]);
-
-        }
-        if (t.size() == 3)
-        {
-            int ttt = 234;
-        }
-    }
+    twins.link();
     return body;
 }